@@ -9,6 +9,7 @@ find_package(MPA)
 set(MODULES
   auloop
   autotest
+  b2bbench
   b2bua
   intercom
   kaoptions
@@ -0,0 +1,220 @@
+/**
+ * @file accextra.h  Cache of parsed account extra parameters
+ *
+ * Copyright (C) 2026 Commend.com - m.fridrich@commend.com
+ */
+
+#ifndef ACCEXTRA_H
+#define ACCEXTRA_H
+
+
+/**
+ * Modules that read settings from the account `extra` parameter keep the
+ * parsed values in an accextra cache. The parse handler of the module is
+ * called once per account, usually on BEVENT_CREATE, and returns a
+ * module-specific settings object. Timers and event handlers then only
+ * look up the cached object.
+ *
+ * An entry references its account. The module drops the entry of a UA
+ * that unregisters, e.g. when it is removed, with accextra_cache_remove()
+ * on BEVENT_UNREGISTERING. The settings are parsed again on next use.
+ */
+
+
+/**
+ * Parse the extra parameters of an account
+ *
+ * @param acc  Account
+ *
+ * @return Settings object (mem_alloc'ed), or NULL
+ */
+typedef void *(accextra_parse_h)(const struct account *acc);
+
+
+struct accextra_cache {
+	struct hash *ht;
+	accextra_parse_h *parseh;
+};
+
+
+struct accextra {
+	struct le he;
+	struct account *acc;
+	void *data;
+};
+
+
+static inline void accextra_destructor(void *arg)
+{
+	struct accextra *ax = arg;
+
+	hash_unlink(&ax->he);
+	mem_deref(ax->data);
+	mem_deref(ax->acc);
+}
+
+
+static inline uint32_t accextra_key(const struct account *acc)
+{
+	return hash_fast((const char *)&acc, sizeof(acc));
+}
+
+
+static inline bool accextra_cmp_handler(struct le *le, void *arg)
+{
+	const struct accextra *ax = le->data;
+
+	return ax->acc == arg;
+}
+
+
+/**
+ * Get a numeric field of the account extra parameter list
+ *
+ * @param acc  Account
+ * @param n    Field name
+ * @param v    Returns the value
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static inline int account_extra_u32(const struct account *acc, const char *n,
+				    uint32_t *v)
+{
+	struct pl pl;
+	struct pl val;
+	const char *extra;
+
+	if (!acc || !n || !v)
+		return EINVAL;
+
+	extra = account_extra(acc);
+	if (!str_isset(extra))
+		return ENOENT;
+
+	pl_set_str(&pl, extra);
+	if (!fmt_param_sep_get(&pl, n, ',', &val))
+		return ENOENT;
+
+	*v = pl_u32(&val);
+
+	return 0;
+}
+
+
+/**
+ * Get a boolean field of the account extra parameter list
+ *
+ * @param acc  Account
+ * @param n    Field name
+ * @param v    Returns the value, unchanged if the field is invalid
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static inline int account_extra_bool(const struct account *acc,
+				     const char *n, bool *v)
+{
+	struct pl pl;
+	struct pl val;
+	const char *extra;
+
+	if (!acc || !n || !v)
+		return EINVAL;
+
+	extra = account_extra(acc);
+	if (!str_isset(extra))
+		return ENOENT;
+
+	pl_set_str(&pl, extra);
+	if (!fmt_param_sep_get(&pl, n, ',', &val))
+		return ENOENT;
+
+	return pl_bool(v, &val);
+}
+
+
+static inline int accextra_cache_init(struct accextra_cache *cache,
+				      accextra_parse_h *parseh)
+{
+	if (!cache || !parseh)
+		return EINVAL;
+
+	cache->parseh = parseh;
+
+	return hash_alloc(&cache->ht, 16);
+}
+
+
+/**
+ * Drop the cached settings of all accounts, e.g. on reload
+ *
+ * @param cache  Settings cache
+ */
+static inline void accextra_cache_flush(struct accextra_cache *cache)
+{
+	if (!cache)
+		return;
+
+	hash_flush(cache->ht);
+}
+
+
+/**
+ * Drop the cached settings of an account
+ *
+ * @param cache  Settings cache
+ * @param acc    Account
+ */
+static inline void accextra_cache_remove(struct accextra_cache *cache,
+					 const struct account *acc)
+{
+	if (!cache || !cache->ht || !acc)
+		return;
+
+	mem_deref(list_ledata(hash_lookup(cache->ht, accextra_key(acc),
+					  accextra_cmp_handler, (void *)acc)));
+}
+
+
+static inline void accextra_cache_close(struct accextra_cache *cache)
+{
+	if (!cache)
+		return;
+
+	hash_flush(cache->ht);
+	cache->ht = mem_deref(cache->ht);
+}
+
+
+/**
+ * Get the cached settings of an account, parse them on first use
+ *
+ * @param cache  Settings cache
+ * @param acc    Account
+ *
+ * @return Settings object, or NULL
+ */
+static inline void *accextra_get(struct accextra_cache *cache,
+				 struct account *acc)
+{
+	struct accextra *ax;
+
+	if (!cache || !cache->ht || !acc)
+		return NULL;
+
+	ax = list_ledata(hash_lookup(cache->ht, accextra_key(acc),
+				     accextra_cmp_handler, acc));
+	if (ax)
+		return ax->data;
+
+	ax = mem_zalloc(sizeof(*ax), accextra_destructor);
+	if (!ax)
+		return NULL;
+
+	ax->acc  = mem_ref(acc);
+	ax->data = cache->parseh(acc);
+	hash_append(cache->ht, accextra_key(acc), &ax->he, ax);
+
+	return ax->data;
+}
+
+#endif
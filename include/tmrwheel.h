@@ -0,0 +1,158 @@
+/**
+ * @file tmrwheel.h  Timing wheel for large numbers of timers
+ *
+ * Copyright (C) 2026 Commend.com - c.huber@commend.com
+ */
+
+#ifndef TMRWHEEL_H
+#define TMRWHEEL_H
+
+
+/**
+ * A timing wheel runs many low-resolution timers on one re timer. The
+ * timers are hashed into slots by their expiry tick. On each tick the slots
+ * since the last tick are checked, and the expired timers are called. The
+ * slot of the current tick is checked again on the next tick, since it may
+ * hold timers that expire later within the tick. A timer that expires later
+ * than one rotation stays in its slot until its expiry time is reached.
+ */
+
+
+enum {
+	TMRWHEEL_SLOTS = 256,    /**< Number of timing wheel slots         */
+};
+
+
+typedef void (tmrwheel_h)(void *arg);
+
+struct tmrwheel;
+
+/** Timer on a timing wheel  */
+struct tmrwheel_tmr {
+	struct le le;
+	struct tmrwheel *tw;
+	uint64_t due;            /**< Expiry time [ms]                     */
+	tmrwheel_h *th;
+	void *arg;
+};
+
+struct tmrwheel {
+	struct list slots[TMRWHEEL_SLOTS];
+	struct tmr tmr;
+	uint64_t tick;           /**< Resolution [ms]                      */
+	uint64_t pos;            /**< Last fully processed tick            */
+	uint32_t cnt;            /**< Number of running timers             */
+};
+
+
+static inline void tmrwheel_init(struct tmrwheel *tw, uint64_t tick)
+{
+	memset(tw, 0, sizeof(*tw));
+	tmr_init(&tw->tmr);
+	tw->tick = tick;
+}
+
+
+static inline void tmrwheel_tmr_cancel(struct tmrwheel_tmr *t)
+{
+	if (!t->le.list)
+		return;
+
+	list_unlink(&t->le);
+	--t->tw->cnt;
+}
+
+
+static inline void tmrwheel_handler(void *arg)
+{
+	struct tmrwheel *tw = arg;
+	uint64_t now = tmr_jiffies();
+	uint64_t pos = now / tw->tick;
+	uint64_t n = min(pos - tw->pos, (uint64_t)TMRWHEEL_SLOTS);
+	struct list expl = LIST_INIT;
+	struct le *le;
+
+	/* collect the expired timers of all slots since the last tick,
+	 * including the current one */
+	tw->pos = pos - n;
+
+	while (n--) {
+		struct list *slot = &tw->slots[++tw->pos % TMRWHEEL_SLOTS];
+
+		le = list_head(slot);
+		while (le) {
+			struct tmrwheel_tmr *t = le->data;
+			le = le->next;
+
+			if (t->due > now)
+				continue;
+
+			list_unlink(&t->le);
+			list_append(&expl, &t->le, t);
+		}
+	}
+
+	/* only the slots before the current tick are done */
+	tw->pos = pos - 1;
+
+	/* the handlers may start and cancel other timers */
+	while ((le = list_head(&expl))) {
+		struct tmrwheel_tmr *t = le->data;
+
+		list_unlink(le);
+		--tw->cnt;
+		t->th(t->arg);
+	}
+
+	if (tw->cnt)
+		tmr_start(&tw->tmr, tw->tick, tmrwheel_handler, tw);
+}
+
+
+/**
+ * Start a timer at an absolute time
+ *
+ * @param tw   Timing wheel
+ * @param t    Timer
+ * @param due  Expiry time [ms], see tmr_jiffies()
+ * @param th   Timeout handler
+ * @param arg  Handler argument
+ */
+static inline void tmrwheel_tmr_start_at(struct tmrwheel *tw,
+					 struct tmrwheel_tmr *t, uint64_t due,
+					 tmrwheel_h *th, void *arg)
+{
+	uint64_t now = tmr_jiffies();
+
+	tmrwheel_tmr_cancel(t);
+
+	/* the slots before the current tick are already processed */
+	t->tw  = tw;
+	t->due = max(due, now);
+	t->th  = th;
+	t->arg = arg;
+
+	list_append(&tw->slots[(t->due / tw->tick) % TMRWHEEL_SLOTS],
+		    &t->le, t);
+
+	if (!tw->cnt++ && !tmr_isrunning(&tw->tmr)) {
+		tw->pos = now / tw->tick - 1;
+		tmr_start(&tw->tmr, tw->tick, tmrwheel_handler, tw);
+	}
+}
+
+
+static inline void tmrwheel_tmr_start(struct tmrwheel *tw,
+				      struct tmrwheel_tmr *t, uint64_t delay,
+				      tmrwheel_h *th, void *arg)
+{
+	tmrwheel_tmr_start_at(tw, t, tmr_jiffies() + delay, th, arg);
+}
+
+
+static inline void tmrwheel_close(struct tmrwheel *tw)
+{
+	tmr_cancel(&tw->tmr);
+}
+
+#endif
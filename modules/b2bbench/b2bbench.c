@@ -0,0 +1,627 @@
+/**
+ * @file b2bbench.c B2BUA load generator and capacity benchmark
+ *
+ * Copyright (C) 2026 Alfred E. Heggestad
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+
+
+/**
+ * @defgroup b2bbench b2bbench
+ *
+ * Load generator for the b2bua module
+ *
+ * A caller UA dials calls at a fixed rate to the inbound side of a B2BUA,
+ * a callee UA answers the calls from its outbound side. Each call is held
+ * for a short time with media and then hung up by the caller. If no
+ * accounts are marked with `b2bbench=caller` and `b2bbench=callee`, the
+ * module creates both UAs on the loopback interface.
+ *
+ * The b2bua module must run in a separate baresip process. All UAs of a
+ * process share its SIP transport, so an INVITE that the caller sends to
+ * a callee in the same process would be matched by the callee UA directly,
+ * and the outbound leg of the b2bua dials the To URI of the inbound call.
+ * The outbound account of the b2bua therefore needs an outbound proxy that
+ * points to the benchmark process, and /b2bbench dials a URI that routes
+ * to the b2bua process, for example:
+ \verbatim
+ b2bua:     <sip:in@127.0.0.1>;regint=0;extra=b2bua=inbound
+            <sip:out@127.0.0.1>;regint=0;extra=b2bua=outbound;
+              outbound="sip:127.0.0.1:5080"
+ b2bbench:  sip_listen 127.0.0.1:5080
+            /b2bbench sip:b2bbench-callee@127.0.0.1:5060 50 10
+ \endverbatim
+ *
+ * The call rate is increased by a fixed step after each step period, or
+ * kept constant if the step is 0. Each call is counted in the step in
+ * which it was dialed. A step is evaluated when all its calls are
+ * established or closed, or at the end of the following step. The
+ * benchmark stops when more than 1% of the calls of a step failed, or the
+ * average setup time of a step exceeded the limit. The highest rate
+ * without failures is reported as the maximum sustainable rate, together
+ * with the setup latency, the peak number of concurrent calls and the
+ * memory per call. The memory statistics of libre are only available if
+ * libre is built with memory debugging.
+ *
+ * Commands:
+ \verbatim
+ /b2bbench <uri> <cps> [step] [period] [hold]
+                         start dialing <cps> calls per second to <uri>,
+                         increase by [step] every [period] seconds and
+                         hang up after [hold] ms (default 0, 10, 1000)
+ /b2bbench_stop          stop the benchmark
+ /b2bbench_stat          print the results
+ \endverbatim
+ *
+ * Configuration:
+ \verbatim
+ b2bbench_max_setup      2000    maximum average setup time per step [ms]
+ \endverbatim
+ */
+
+
+enum {
+	TICK_MS      = 10,       /**< Dial timer interval [ms]             */
+	HASH_SIZE    = 1024,     /**< Hash size of benchmark calls         */
+	NSTEPS       = 2,        /**< Dialing and evaluated step           */
+	MAX_FAIL_PPM = 10000,    /**< Maximum failed calls per step [ppm]  */
+};
+
+
+/** One benchmark call, seen from the caller UA  */
+struct bcall {
+	struct le he;
+	struct call *call;       /**< Call object, owned by the caller UA  */
+	struct tmr tmr;          /**< Hangup timer                         */
+	uint64_t ts_start;       /**< Time of the INVITE [ms]              */
+	uint32_t step;           /**< Index of the dialing step            */
+	bool estab;              /**< Call was established                 */
+};
+
+
+/** Counters of one step, or of the whole run  */
+struct bstats {
+	uint32_t dialed;         /**< Calls dialed                         */
+	uint32_t estab;          /**< Calls established                    */
+	uint32_t failed;         /**< Calls closed before established      */
+	uint64_t setup_sum;      /**< Sum of setup times [ms]              */
+	uint64_t setup_min;      /**< Minimum setup time [ms]              */
+	uint64_t setup_max;      /**< Maximum setup time [ms]              */
+};
+
+
+/** One step of the call rate  */
+struct bstep {
+	struct bstats st;
+	uint32_t idx;            /**< Step index                           */
+	uint32_t cps;            /**< Call rate of the step [calls/s]      */
+	uint32_t pending;        /**< Calls not established or closed yet  */
+	bool dialed;             /**< All calls of the step are dialed     */
+	bool done;               /**< Step is evaluated                    */
+};
+
+
+static struct {
+	struct ua *caller;
+	struct ua *callee;
+	bool own_caller;         /**< Caller UA is created by the module   */
+	bool own_callee;         /**< Callee UA is created by the module   */
+	struct hash *calls;      /**< Active benchmark calls by Call-ID    */
+	char *uri;               /**< Target URI                           */
+	struct tmr tmr_dial;
+	bool running;
+	uint32_t cps;            /**< Current call rate [calls/s]          */
+	uint32_t idx;            /**< Index of the dialing step            */
+	uint32_t step;           /**< Call rate increment per step         */
+	uint32_t period;         /**< Step period [s]                      */
+	uint32_t hold;           /**< Call hold time [ms]                  */
+	uint32_t max_setup;      /**< Maximum average setup time [ms]      */
+	uint64_t ts_step;        /**< Start of the current step [ms]       */
+	uint32_t max_cps;        /**< Highest call rate without failures   */
+	uint32_t active;         /**< Active calls                         */
+	uint32_t peak;           /**< Peak number of active calls          */
+	bool mem_stat;           /**< libre memory statistics available    */
+	size_t mem_base;         /**< Allocated bytes before the run       */
+	size_t mem_call;         /**< Allocated bytes per active call      */
+	struct bstep stepv[NSTEPS]; /**< Steps by index modulo NSTEPS      */
+	struct bstats st_total;
+} d = {
+	.max_setup = 2000,
+};
+
+
+static void bcall_destructor(void *arg)
+{
+	struct bcall *bc = arg;
+
+	tmr_cancel(&bc->tmr);
+	hash_unlink(&bc->he);
+	--d.active;
+}
+
+
+static bool bcall_cmp_handler(struct le *le, void *arg)
+{
+	const struct bcall *bc = le->data;
+
+	return bc->call == arg;
+}
+
+
+static struct bcall *bcall_find(const struct call *call)
+{
+	return list_ledata(hash_lookup(d.calls, hash_fast_str(call_id(call)),
+				       bcall_cmp_handler, (void *)call));
+}
+
+
+static void bstats_setup(struct bstats *st, uint64_t ms)
+{
+	if (!st->estab || ms < st->setup_min)
+		st->setup_min = ms;
+
+	if (ms > st->setup_max)
+		st->setup_max = ms;
+
+	++st->estab;
+	st->setup_sum += ms;
+}
+
+
+/* Returns 0 if libre is built without memory debugging */
+static size_t mem_bytes(void)
+{
+	struct memstat mstat;
+
+	if (mem_get_stat(&mstat))
+		return 0;
+
+	return mstat.bytes_cur;
+}
+
+
+static struct bstep *step_cur(void)
+{
+	return &d.stepv[d.idx % NSTEPS];
+}
+
+
+/* Step of a call, or NULL if the step is no longer kept */
+static struct bstep *step_get(uint32_t idx)
+{
+	struct bstep *s = &d.stepv[idx % NSTEPS];
+
+	/* a step always has a call rate */
+	return s->cps && s->idx == idx ? s : NULL;
+}
+
+
+static void hangup_handler(void *arg)
+{
+	struct bcall *bc = arg;
+	struct call *call = bc->call;
+
+	mem_deref(bc);
+	ua_hangup(d.caller, call, 0, NULL);
+}
+
+
+static int dial(void)
+{
+	struct bcall *bc;
+	int err;
+
+	bc = mem_zalloc(sizeof(*bc), bcall_destructor);
+	if (!bc)
+		return ENOMEM;
+
+	++d.active;
+	bc->ts_start = tmr_jiffies();
+	bc->step     = d.idx;
+
+	err = ua_connect(d.caller, &bc->call, NULL, d.uri, VIDMODE_OFF);
+	if (err) {
+		mem_deref(bc);
+		return err;
+	}
+
+	hash_append(d.calls, hash_fast_str(call_id(bc->call)), &bc->he, bc);
+
+	d.peak = max(d.peak, d.active);
+	++step_cur()->pending;
+
+	return 0;
+}
+
+
+static void bench_stop(void)
+{
+	tmr_cancel(&d.tmr_dial);
+	d.running = false;
+
+	info("b2bbench: stopped at %u calls/s, max sustainable %u calls/s\n",
+	     d.cps, d.max_cps);
+}
+
+
+/* Evaluate a dialed step, returns true to continue */
+static bool step_end(struct bstep *s)
+{
+	const struct bstats *st = &s->st;
+	uint32_t done = st->estab + st->failed;
+	uint64_t avg = st->estab ? st->setup_sum / st->estab : 0;
+
+	s->done = true;
+
+	info("b2bbench: %u calls/s: dialed %u, established %u, failed %u, "
+	     "pending %u, setup avg %llu ms\n",
+	     s->cps, st->dialed, st->estab, st->failed, s->pending, avg);
+
+	if (done && (uint64_t)st->failed * 1000000 > (uint64_t)done *
+	    MAX_FAIL_PPM)
+		return false;
+
+	if (avg > d.max_setup)
+		return false;
+
+	d.max_cps = max(d.max_cps, s->cps);
+
+	return true;
+}
+
+
+/* Evaluate a dialed step once all its calls have an outcome */
+static void step_check(struct bstep *s)
+{
+	if (!d.running || !s || !s->dialed || s->done || s->pending)
+		return;
+
+	if (!step_end(s))
+		bench_stop();
+}
+
+
+static void step_start(uint32_t idx, uint32_t cps)
+{
+	struct bstep *s = &d.stepv[idx % NSTEPS];
+
+	memset(s, 0, sizeof(*s));
+	s->idx = idx;
+	s->cps = cps;
+
+	d.idx     = idx;
+	d.cps     = cps;
+	d.ts_step = tmr_jiffies();
+}
+
+
+static void dial_handler(void *arg)
+{
+	uint64_t now = tmr_jiffies();
+	struct bstep *s = step_cur();
+	struct bstep *prev;
+	size_t mem;
+	uint64_t due;
+	(void)arg;
+
+	if (now - d.ts_step >= d.period * 1000ULL) {
+
+		mem = mem_bytes();
+		if (d.active && mem > d.mem_base)
+			d.mem_call = (mem - d.mem_base) / d.active;
+
+		/* the previous step had a full period for its calls */
+		prev = step_get(d.idx - 1);
+		if (prev && !prev->done && !step_end(prev)) {
+			bench_stop();
+			return;
+		}
+
+		s->dialed = true;
+		step_check(s);
+		if (!d.running)
+			return;
+
+		step_start(d.idx + 1, d.cps + d.step);
+		s = step_cur();
+	}
+
+	tmr_start(&d.tmr_dial, TICK_MS, dial_handler, NULL);
+
+	/* dial the calls that are due since the start of the step */
+	due = d.cps * (now - d.ts_step) / 1000;
+
+	while (s->st.dialed < due) {
+
+		int err = dial();
+
+		++s->st.dialed;
+		++d.st_total.dialed;
+
+		if (err) {
+			++s->st.failed;
+			++d.st_total.failed;
+		}
+	}
+}
+
+
+static void call_established(struct bcall *bc)
+{
+	struct bstep *s = step_get(bc->step);
+	uint64_t ms = tmr_jiffies() - bc->ts_start;
+
+	bc->estab = true;
+	bstats_setup(&d.st_total, ms);
+
+	tmr_start(&bc->tmr, d.hold, hangup_handler, bc);
+
+	if (!s)
+		return;
+
+	bstats_setup(&s->st, ms);
+	--s->pending;
+	step_check(s);
+}
+
+
+static void call_closed(struct bcall *bc)
+{
+	struct bstep *s = step_get(bc->step);
+	bool estab = bc->estab;
+
+	mem_deref(bc);
+
+	if (estab)
+		return;
+
+	++d.st_total.failed;
+
+	if (!s)
+		return;
+
+	++s->st.failed;
+	--s->pending;
+	step_check(s);
+}
+
+
+static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
+{
+	struct ua *ua = bevent_get_ua(event);
+	struct call *call = bevent_get_call(event);
+	struct bcall *bc;
+	int err;
+	(void)arg;
+
+	if (!ua || !call)
+		return;
+
+	if (ua == d.callee) {
+
+		if (ev != BEVENT_CALL_INCOMING)
+			return;
+
+		err = call_answer(call, 200, VIDMODE_OFF);
+		if (err)
+			warning("b2bbench: answer failed (%m)\n", err);
+
+		return;
+	}
+
+	if (ua != d.caller)
+		return;
+
+	bc = bcall_find(call);
+	if (!bc)
+		return;
+
+	switch (ev) {
+
+	case BEVENT_CALL_ESTABLISHED:
+		call_established(bc);
+		break;
+
+	case BEVENT_CALL_CLOSED:
+		call_closed(bc);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static int bstats_print(struct re_printf *pf, const struct bstats *st)
+{
+	return re_hprintf(pf, "dialed %u, established %u, failed %u, "
+			  "setup min/avg/max %llu/%llu/%llu ms",
+			  st->dialed, st->estab, st->failed,
+			  st->setup_min,
+			  st->estab ? st->setup_sum / st->estab : 0,
+			  st->setup_max);
+}
+
+
+static int cmd_start(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct pl uri, cps, step = PL_INIT, period = PL_INIT, hold = PL_INIT;
+	int err;
+
+	if (!d.caller || !d.callee)
+		return re_hprintf(pf, "b2bbench: caller and callee UA "
+				  "must be configured\n");
+
+	if (d.running)
+		return re_hprintf(pf, "b2bbench: already running\n");
+
+	err = re_regex(carg->prm, str_len(carg->prm),
+		       "[^ ]+ [0-9]+[ ]*[0-9]*[ ]*[0-9]*[ ]*[0-9]*",
+		       &uri, &cps, NULL, &step, NULL, &period, NULL, &hold);
+	if (err || !pl_u32(&cps))
+		return re_hprintf(pf, "usage: /b2bbench <uri> <cps> "
+				  "[step] [period] [hold]\n");
+
+	d.uri = mem_deref(d.uri);
+	err = account_uri_complete_strdup(ua_account(d.caller), &d.uri, &uri);
+	if (err)
+		return err;
+
+	d.cps    = pl_u32(&cps);
+	d.step   = pl_isset(&step)   ? pl_u32(&step)   : 0;
+	d.period = pl_isset(&period) ? pl_u32(&period) : 10;
+	d.hold   = pl_isset(&hold)   ? pl_u32(&hold)   : 1000;
+	if (!d.period)
+		d.period = 1;
+
+	memset(d.stepv, 0, sizeof(d.stepv));
+	memset(&d.st_total, 0, sizeof(d.st_total));
+	d.max_cps  = 0;
+	d.peak     = d.active;
+	d.mem_base = mem_bytes();
+	d.mem_stat = d.mem_base != 0;
+	d.mem_call = 0;
+	d.running  = true;
+
+	/* the calls of a previous run are not counted */
+	step_start(d.idx + NSTEPS, d.cps);
+
+	tmr_start(&d.tmr_dial, TICK_MS, dial_handler, NULL);
+
+	return re_hprintf(pf, "b2bbench: dialing %s at %u calls/s, "
+			  "step %u every %u s, hold %u ms\n",
+			  d.uri, d.cps, d.step, d.period, d.hold);
+}
+
+
+static int cmd_stop(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	if (!d.running)
+		return re_hprintf(pf, "b2bbench: not running\n");
+
+	bench_stop();
+
+	return 0;
+}
+
+
+static int cmd_stat(struct re_printf *pf, void *arg)
+{
+	int err = 0;
+	(void)arg;
+
+	err |= re_hprintf(pf, "b2bbench: %s, %u calls/s\n",
+			  d.running ? "running" : "stopped", d.cps);
+	err |= re_hprintf(pf, "  total:    %H\n", bstats_print, &d.st_total);
+	err |= re_hprintf(pf, "  step:     %H\n", bstats_print,
+			  &step_cur()->st);
+	err |= re_hprintf(pf, "  max cps:  %u\n", d.max_cps);
+	err |= re_hprintf(pf, "  calls:    %u active, %u peak\n",
+			  d.active, d.peak);
+
+	if (!d.mem_stat)
+		err |= re_hprintf(pf, "  memory:   n/a (requires libre with "
+				  "memory debugging)\n");
+	else if (d.mem_call)
+		err |= re_hprintf(pf, "  memory:   %zu bytes per call\n",
+				  d.mem_call);
+	else
+		err |= re_hprintf(pf, "  memory:   n/a\n");
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{"b2bbench",      0, CMD_PRM, "Start b2bua benchmark", cmd_start },
+	{"b2bbench_stop", 0,       0, "Stop b2bua benchmark",  cmd_stop  },
+	{"b2bbench_stat", 0,       0, "b2bua benchmark results", cmd_stat },
+};
+
+
+/* Find the UA of a role, or create it on the loopback interface */
+static int bench_ua(struct ua **uap, bool *own, const char *role)
+{
+	char aor[64];
+	int err;
+
+	*uap = uag_find_param("b2bbench", role);
+	if (*uap)
+		return 0;
+
+	if (re_snprintf(aor, sizeof(aor),
+			"<sip:b2bbench-%s@127.0.0.1>;regint=0", role) < 0)
+		return ENOMEM;
+
+	err = ua_alloc(uap, aor);
+	if (err) {
+		warning("b2bbench: could not create %s UA (%m)\n", role, err);
+		return err;
+	}
+
+	*own = true;
+	info("b2bbench: %s UA %s\n", role, account_aor(ua_account(*uap)));
+
+	return 0;
+}
+
+
+static int module_init(void)
+{
+	int err;
+
+	err = bench_ua(&d.caller, &d.own_caller, "caller");
+	if (err)
+		return err;
+
+	err = bench_ua(&d.callee, &d.own_callee, "callee");
+	if (err)
+		return err;
+
+	(void)conf_get_u32(conf_cur(), "b2bbench_max_setup", &d.max_setup);
+
+	err = hash_alloc(&d.calls, HASH_SIZE);
+	if (err)
+		return err;
+
+	err = bevent_register(event_handler, NULL);
+	if (err)
+		return err;
+
+	return cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
+}
+
+
+static int module_close(void)
+{
+	tmr_cancel(&d.tmr_dial);
+	cmd_unregister(baresip_commands(), cmdv);
+	bevent_unregister(event_handler);
+
+	hash_flush(d.calls);
+	d.calls = mem_deref(d.calls);
+	d.uri   = mem_deref(d.uri);
+
+	if (d.own_caller)
+		(void)ua_destroy(d.caller);
+	if (d.own_callee)
+		(void)ua_destroy(d.callee);
+
+	d.caller = d.callee = NULL;
+	d.own_caller = d.own_callee = false;
+
+	return 0;
+}
+
+
+const struct mod_export DECL_EXPORTS(b2bbench) = {
+	"b2bbench",
+	"application",
+	module_init,
+	module_close
+};
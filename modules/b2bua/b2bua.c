@@ -6,6 +6,8 @@
 #include <re.h>
 #include <baresip.h>
 
+#include "b2bua.h"
+
 
 /**
  * @defgroup b2bua b2bua
@@ -16,17 +18,120 @@
  *
  * N session objects
  * 1 session object has 2 call objects (left, right leg)
+ *
+ * The audio of both call legs is bridged via virtual A/B devices, which
+ * decodes and re-encodes every packet. If both legs negotiated the same
+ * audio codec the session switches to a packet-level RTP relay instead,
+ * which forwards the payload and rewrites only SSRC, sequence number and
+ * timestamp. The relay is not used with media encryption. The audio
+ * streams do not receive the relayed packets, so the RTP timeout of both
+ * calls is disabled while the relay is running.
+ *
+ * Each session is labeled with its media path once both legs are
+ * established: relay, pcm-bridge (same sample rate and channels) or
+ * resample-bridge. The status command shows the share of each path.
+ *
+ * The RTP relay forwards RFC 4733 telephone-events with the audio. If the
+ * audio is bridged and both legs negotiated telephone-event, the events
+ * are relayed at packet level into the audio stream of the other leg, so
+ * that their timestamps and durations are kept. Otherwise the received
+ * digits are sent again with call_send_digit().
+ *
+ * In passthrough mode the outbound leg offers the audio codecs of the
+ * caller's offer first (those of the outbound account, in the caller's
+ * order), followed by the remaining codecs of the outbound account, so
+ * that a callee without a common codec is still transcoded. Early media
+ * (183 Session Progress) of the outbound leg is forwarded to the caller,
+ * so that the media path is set up before the answer.
+ *
+ * Aggregate statistics are kept for all sessions and printed as JSON by
+ * the b2bua_stats command. The setup time is measured from the incoming
+ * INVITE until both legs are established.
+ *
+ * Configuration:
+ \verbatim
+ b2bua_relay             yes     use the RTP relay for matching codecs
+ b2bua_passthrough       yes     prefer the caller's codecs, relay 183
+ b2bua_threads           0       number of media threads for the relay
+ b2bua_dtmf_relay        yes     relay RFC 4733 events of bridged calls
+ \endverbatim
  */
 
 
+enum {
+	SESSION_HASH_SIZE = 1024,
+	SETUP_BUCKETS     = 9,   /**< Number of setup time buckets         */
+	RATE_SLOTS        = 10,  /**< Session rate window [s]              */
+};
+
+/** Upper bounds of the setup time buckets in [ms]  */
+static const uint64_t setup_bounds[SETUP_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2000, 5000, 10000, 30000
+};
+
+
+/** Media path between the two call legs, ordered by cost */
+enum media_path {
+	PATH_PENDING = 0,    /**< Not yet established on both legs        */
+	PATH_RELAY,          /**< Packet-level RTP relay                  */
+	PATH_BRIDGE,         /**< Decode/encode bridge at the same rate   */
+	PATH_RESAMPLE,       /**< Decode/encode bridge with resampling    */
+
+	PATH_MAX
+};
+
+
 struct session {
 	struct le le;
+	struct le he_in;
+	struct le he_out;
 	struct call *call_in, *call_out;
+	bool estab_in, estab_out;
+	enum media_path path;
+	struct relay *relay;
+	struct relay *evrelay;   /**< Telephone-event relay of a bridge    */
+	uint64_t ts_start;       /**< Time of the incoming INVITE [ms]     */
 };
 
 
+/** Aggregate statistics of all sessions  */
+static struct {
+	uint32_t active;         /**< Active sessions                      */
+	uint64_t sessions;       /**< Total number of sessions             */
+	uint64_t established;    /**< Sessions established on both legs    */
+	uint64_t failed;         /**< Sessions closed before established   */
+	uint64_t paths[PATH_MAX];    /**< Established sessions per path    */
+	uint64_t npkts;          /**< Bridged packets of closed sessions   */
+	uint64_t nbytes;         /**< Bridged bytes of closed sessions     */
+	uint64_t setup_sum;      /**< Sum of setup times [ms]              */
+	uint64_t setup_min;      /**< Minimum setup time [ms]              */
+	uint64_t setup_max;      /**< Maximum setup time [ms]              */
+	uint64_t setup_hist[SETUP_BUCKETS];  /**< Setup time histogram     */
+	uint64_t rate_sec[RATE_SLOTS];   /**< Second of each rate slot     */
+	uint32_t rate_cnt[RATE_SLOTS];   /**< New sessions per second      */
+} stats;
+
+
 static struct list sessionl;
+static struct hash *sessionh;      /**< Sessions by Call-ID of both legs */
 static struct ua *ua_in, *ua_out;
+static bool relay_enabled = true;
+static bool passthrough = true;
+static bool dtmf_relay = true;
+static char *acc_codecs;           /**< Own audio codecs of outbound acc */
+
+
+static const char *path_name(enum media_path path)
+{
+	switch (path) {
+
+	case PATH_PENDING:  return "pending";
+	case PATH_RELAY:    return "relay";
+	case PATH_BRIDGE:   return "pcm-bridge";
+	case PATH_RESAMPLE: return "resample-bridge";
+	default:            return "???";
+	}
+}
 
 
 static struct call *other_call(struct session *sess, const struct call *call)
@@ -38,32 +143,353 @@ static struct call *other_call(struct session *sess, const struct call *call)
 }
 
 
+/* Packets and bytes that were bridged between the legs */
+static void session_media(const struct session *sess, uint64_t *npkts,
+			  uint64_t *nbytes)
+{
+	const struct stream *strm_in  = audio_strm(call_audio(sess->call_in));
+	const struct stream *strm_out = audio_strm(call_audio(sess->call_out));
+
+	if (sess->relay) {
+		relay_stats(sess->relay, npkts, nbytes);
+		return;
+	}
+
+	*npkts  = stream_metric_get_rx_n_packets(strm_in) +
+		  stream_metric_get_rx_n_packets(strm_out);
+	*nbytes = stream_metric_get_rx_n_bytes(strm_in) +
+		  stream_metric_get_rx_n_bytes(strm_out);
+}
+
+
 static void destructor(void *arg)
 {
 	struct session *sess = arg;
+	uint64_t npkts = 0, nbytes = 0;
 
 	debug("b2bua: session destroyed (in=%p, out=%p)\n",
 	      sess->call_in, sess->call_out);
 
+	if (sess->le.list) {
+		session_media(sess, &npkts, &nbytes);
+		stats.npkts  += npkts;
+		stats.nbytes += nbytes;
+		--stats.active;
+
+		if (sess->path == PATH_PENDING)
+			++stats.failed;
+	}
+
 	list_unlink(&sess->le);
+	hash_unlink(&sess->he_in);
+	hash_unlink(&sess->he_out);
+	relay_close(sess->relay);
+	relay_close(sess->evrelay);
 	mem_deref(sess->call_out);
 	mem_deref(sess->call_in);
 }
 
 
+static bool session_cmp_handler(struct le *le, void *arg)
+{
+	const struct session *sess = le->data;
+	const char *id = arg;
+
+	return 0 == str_cmp(call_id(sess->call_in), id) ||
+	       0 == str_cmp(call_id(sess->call_out), id);
+}
+
+
+static struct session *session_find(const char *id)
+{
+	return list_ledata(hash_lookup(sessionh, hash_fast_str(id),
+				       session_cmp_handler, (void *)id));
+}
+
+
+static bool offer_has(const struct list *fmtl, const struct aucodec *ac)
+{
+	struct le *le;
+
+	for (le = list_head(fmtl); le; le = le->next) {
+		const struct sdp_format *fmt = le->data;
+
+		if (fmt->srate == ac->srate && fmt->ch == ac->ch &&
+		    !str_casecmp(fmt->name, ac->name))
+			return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * Print the caller's offered audio codecs that the outbound account
+ * supports, followed by the other codecs of the outbound account
+ */
+static int offer_print(struct re_printf *pf, const struct call *call)
+{
+	const struct list *acl = account_aucodecl(ua_account(ua_out));
+	const struct list *fmtl;
+	struct le *le;
+	bool first = true;
+	int err = 0;
+
+	fmtl = sdp_media_format_lst(stream_sdpmedia(audio_strm(
+					   call_audio(call))), false);
+
+	for (le = list_head(fmtl); le; le = le->next) {
+		const struct sdp_format *fmt = le->data;
+
+		if (!aucodec_find(acl, fmt->name, fmt->srate, fmt->ch))
+			continue;
+
+		err |= re_hprintf(pf, "%s%s/%u/%u", first ? "" : ",",
+				  fmt->name, fmt->srate, fmt->ch);
+		first = false;
+	}
+
+	for (le = list_head(acl); le; le = le->next) {
+		const struct aucodec *ac = le->data;
+
+		if (offer_has(fmtl, ac))
+			continue;
+
+		err |= re_hprintf(pf, "%s%s/%u/%u", first ? "" : ",",
+				  ac->name, ac->srate, ac->ch);
+		first = false;
+	}
+
+	return err;
+}
+
+
+static int aucodecl_print(struct re_printf *pf, const struct list *lst)
+{
+	struct le *le;
+	int err = 0;
+
+	for (le = list_head(lst); le; le = le->next) {
+		const struct aucodec *ac = le->data;
+
+		err |= re_hprintf(pf, "%s%s/%u/%u", le == lst->head ? "" : ",",
+				  ac->name, ac->srate, ac->ch);
+	}
+
+	return err;
+}
+
+
+static bool aucodec_equal(const struct aucodec *a, const struct aucodec *b)
+{
+	if (!a || !b)
+		return false;
+
+	return a->srate == b->srate && a->ch == b->ch &&
+	       !str_casecmp(a->name, b->name);
+}
+
+
+static bool session_relay(struct session *sess)
+{
+	struct audio *au_in  = call_audio(sess->call_in);
+	struct audio *au_out = call_audio(sess->call_out);
+	int err;
+
+	if (!relay_enabled)
+		return false;
+
+	if (str_isset(account_mediaenc(call_account(sess->call_in))) ||
+	    str_isset(account_mediaenc(call_account(sess->call_out))))
+		return false;
+
+	err = relay_alloc(&sess->relay, sess->call_in, sess->call_out,
+			  shard_get(call_id(sess->call_in)), RELAY_MEDIA);
+	if (err) {
+		warning("b2bua: could not start RTP relay (%m)\n", err);
+		return false;
+	}
+
+	/* the relay bypasses decoder, audio bridge and encoder */
+	audio_stop(au_in);
+	audio_stop(au_out);
+
+	/* the streams do not see the relayed RTP packets */
+	call_enable_rtp_timeout(sess->call_in, 0);
+	call_enable_rtp_timeout(sess->call_out, 0);
+
+	debug("b2bua: RTP relay started (in=%p, out=%p)\n",
+	      sess->call_in, sess->call_out);
+
+	return true;
+}
+
+
+static void stats_session(uint64_t now)
+{
+	uint64_t sec = now / 1000;
+	unsigned slot = (unsigned)(sec % RATE_SLOTS);
+
+	if (stats.rate_sec[slot] != sec) {
+		stats.rate_sec[slot] = sec;
+		stats.rate_cnt[slot] = 0;
+	}
+
+	++stats.rate_cnt[slot];
+	++stats.sessions;
+	++stats.active;
+}
+
+
+/* New sessions per second, averaged over the last RATE_SLOTS seconds */
+static double stats_rate(void)
+{
+	uint64_t sec = tmr_jiffies() / 1000;
+	uint32_t n = 0;
+	unsigned i;
+
+	for (i = 0; i < RATE_SLOTS; i++) {
+		if (sec - stats.rate_sec[i] < RATE_SLOTS)
+			n += stats.rate_cnt[i];
+	}
+
+	return (double)n / RATE_SLOTS;
+}
+
+
+/* Upper bound of the bucket that contains the given percentile [ms] */
+static uint64_t stats_percentile(unsigned pct)
+{
+	uint64_t n = 0, rank;
+	unsigned i;
+
+	if (!stats.established)
+		return 0;
+
+	rank = (stats.established * pct + 99) / 100;
+
+	for (i = 0; i < RE_ARRAY_SIZE(setup_bounds); i++) {
+		n += stats.setup_hist[i];
+		if (n >= rank)
+			return min(setup_bounds[i], stats.setup_max);
+	}
+
+	return stats.setup_max;
+}
+
+
+static void stats_setup(uint64_t ms)
+{
+	unsigned i;
+
+	for (i = 0; i < RE_ARRAY_SIZE(setup_bounds); i++) {
+		if (ms < setup_bounds[i])
+			break;
+	}
+
+	if (!stats.established || ms < stats.setup_min)
+		stats.setup_min = ms;
+
+	if (ms > stats.setup_max)
+		stats.setup_max = ms;
+
+	++stats.established;
+	++stats.setup_hist[i];
+	stats.setup_sum += ms;
+}
+
+
+static void session_evrelay(struct session *sess)
+{
+	int err;
+
+	if (!dtmf_relay)
+		return;
+
+	if (str_isset(account_mediaenc(call_account(sess->call_in))) ||
+	    str_isset(account_mediaenc(call_account(sess->call_out))))
+		return;
+
+	err = relay_alloc(&sess->evrelay, sess->call_in, sess->call_out,
+			  NULL, RELAY_EVENTS);
+	if (err == ENOENT)
+		return;
+	else if (err)
+		warning("b2bua: could not start event relay (%m)\n", err);
+}
+
+
+/*
+ * Select the cheapest media path from the audio codecs that were
+ * negotiated on both legs. Identical codecs are relayed, otherwise the
+ * audio is transcoded via the A/B bridge devices.
+ */
+static void session_path(struct session *sess)
+{
+	const struct aucodec *ac_in, *ac_out;
+
+	if (sess->path != PATH_PENDING)
+		return;
+
+	ac_in  = audio_codec(call_audio(sess->call_in), true);
+	ac_out = audio_codec(call_audio(sess->call_out), true);
+
+	if (aucodec_equal(ac_in, ac_out) && session_relay(sess))
+		sess->path = PATH_RELAY;
+	else if (!ac_in || !ac_out ||
+		 (ac_in->srate == ac_out->srate && ac_in->ch == ac_out->ch))
+		sess->path = PATH_BRIDGE;
+	else
+		sess->path = PATH_RESAMPLE;
+
+	if (sess->path != PATH_RELAY)
+		session_evrelay(sess);
+
+	++stats.paths[sess->path];
+	stats_setup(tmr_jiffies() - sess->ts_start);
+
+	info("b2bua: media path %s (%s/%u/%u <-> %s/%u/%u)\n",
+	     path_name(sess->path),
+	     ac_in  ? ac_in->name  : "none", ac_in  ? ac_in->srate  : 0,
+	     ac_in  ? ac_in->ch    : 0,
+	     ac_out ? ac_out->name : "none", ac_out ? ac_out->srate : 0,
+	     ac_out ? ac_out->ch   : 0);
+}
+
+
 static void call_event_handler(struct call *call, enum call_event ev,
 			       const char *str, void *arg)
 {
 	struct session *sess = arg;
 	struct call *call2 = other_call(sess, call);
+	int err;
 
 	switch (ev) {
 
+	case CALL_EVENT_PROGRESS:
+		if (!passthrough || call != sess->call_out)
+			break;
+
+		debug("b2bua: CALL_PROGRESS: forwarding early media\n");
+
+		err = call_progress(sess->call_in);
+		if (err)
+			warning("b2bua: call_progress failed (%m)\n", err);
+		break;
+
 	case CALL_EVENT_ESTABLISHED:
 		debug("b2bua: CALL_ESTABLISHED: peer_uri=%s\n",
 		      call_peeruri(call));
 		call_answer(call2, 200,
 			    call_has_video(call) ? VIDMODE_ON : VIDMODE_OFF);
+
+		if (call == sess->call_in)
+			sess->estab_in = true;
+		else
+			sess->estab_out = true;
+
+		if (sess->estab_in && sess->estab_out)
+			session_path(sess);
 		break;
 
 	case CALL_EVENT_CLOSED:
@@ -91,7 +517,9 @@ static void call_dtmf_handler(struct call *call, char key, void *arg)
 
 static int new_session(struct call *call)
 {
+	struct account *acc = ua_account(ua_out);
 	struct session *sess;
+	char codecs[256] = "";
 	char a[64], b[64];
 	int err;
 
@@ -99,10 +527,24 @@ static int new_session(struct call *call)
 	if (!sess)
 		return ENOMEM;
 
+	sess->ts_start = tmr_jiffies();
+
+	/* the offer is created by ua_connect(), so the outbound account
+	 * carries the reordered codecs while connecting */
+	if (passthrough && re_snprintf(codecs, sizeof(codecs), "%H",
+				       offer_print, call) < 0)
+		codecs[0] = '\0';
+	if (str_isset(codecs))
+		(void)account_set_audio_codecs(acc, codecs);
+
 	sess->call_in = call;
 	err = ua_connect(ua_out, &sess->call_out, call_peeruri(call),
 			 call_localuri(call),
 			 call_has_video(call) ? VIDMODE_ON : VIDMODE_OFF);
+
+	if (str_isset(codecs))
+		(void)account_set_audio_codecs(acc, acc_codecs);
+
 	if (err) {
 		warning("b2bua: ua_connect failed (%m)\n", err);
 		goto out;
@@ -123,6 +565,12 @@ static int new_session(struct call *call)
 			  call_dtmf_handler, sess);
 
 	list_append(&sessionl, &sess->le, sess);
+	hash_append(sessionh, hash_fast_str(call_id(sess->call_in)),
+		    &sess->he_in, sess);
+	hash_append(sessionh, hash_fast_str(call_id(sess->call_out)),
+		    &sess->he_out, sess);
+
+	stats_session(sess->ts_start);
 
  out:
 	if (err)
@@ -135,12 +583,16 @@ static int new_session(struct call *call)
 static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 {
 	struct call *call = bevent_get_call(event);
+	struct session *sess;
 	int err;
 	(void)arg;
 
 	switch (ev) {
 
 	case BEVENT_CALL_INCOMING:
+		if (bevent_get_ua(event) != ua_in)
+			break;
+
 		debug("b2bua: CALL_INCOMING: peer=%s  -->  local=%s\n",
 		      call_peeruri(call), call_localuri(call));
 
@@ -150,16 +602,47 @@ static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 		}
 		break;
 
+	case BEVENT_CALL_REMOTE_SDP:
+	case BEVENT_CALL_HOLD:
+	case BEVENT_CALL_RESUME:
+		sess = session_find(call_id(call));
+		if (!sess)
+			break;
+
+		relay_update(sess->relay);
+		relay_update(sess->evrelay);
+		break;
+
 	default:
 		break;
 	}
 }
 
 
+static int session_debug(struct re_printf *pf, const struct session *sess)
+{
+	int err = 0;
+
+	err |= re_hprintf(pf, "%-42s  --->  %42s  [%s]\n",
+			  call_peeruri(sess->call_in),
+			  call_peeruri(sess->call_out),
+			  path_name(sess->path));
+
+	err |= re_hprintf(pf, " %H\n", call_status, sess->call_in);
+	err |= re_hprintf(pf, " %H\n", call_status, sess->call_out);
+	if (sess->relay)
+		err |= re_hprintf(pf, " %H\n", relay_debug, sess->relay);
+	if (sess->evrelay)
+		err |= re_hprintf(pf, " %H\n", relay_debug, sess->evrelay);
+
+	return err;
+}
+
+
 static int b2bua_status(struct re_printf *pf, void *arg)
 {
 	struct le *le;
-	int err = 0;
+	int i, err = 0;
 	(void)arg;
 
 	err |= re_hprintf(pf, "B2BUA status:\n");
@@ -168,31 +651,125 @@ static int b2bua_status(struct re_printf *pf, void *arg)
 	err |= re_hprintf(pf, "  outbound: %s\n",
 			  account_aor(ua_account(ua_out)));
 
+	err |= re_hprintf(pf, "media paths:\n");
+	for (i = PATH_RELAY; i < PATH_MAX; i++) {
+		err |= re_hprintf(pf, "  %-16s %llu (%u%%)\n",
+				  path_name(i), stats.paths[i],
+				  stats.established ? (unsigned)
+				  (100 * stats.paths[i] / stats.established) :
+				  0);
+	}
+
+	err |= shard_debug(pf, NULL);
+
 	err |= re_hprintf(pf, "sessions:\n");
 
-	for (le = sessionl.head; le; le = le->next) {
+	for (le = sessionl.head; le; le = le->next)
+		err |= session_debug(pf, le->data);
 
-		struct session *sess = le->data;
+	return err;
+}
 
-		err |= re_hprintf(pf, "%-42s  --->  %42s\n",
-				  call_peeruri(sess->call_in),
-				  call_peeruri(sess->call_out));
 
-		err |= re_hprintf(pf, " %H\n", call_status, sess->call_in);
-		err |= re_hprintf(pf, " %H\n", call_status, sess->call_out);
+static int b2bua_stats(struct re_printf *pf, void *arg)
+{
+	uint64_t npkts = stats.npkts, nbytes = stats.nbytes;
+	uint64_t transcoded;
+	struct le *le;
+	int err = 0;
+	(void)arg;
+
+	for (le = sessionl.head; le; le = le->next) {
+		uint64_t p = 0, b = 0;
+
+		session_media(le->data, &p, &b);
+		npkts  += p;
+		nbytes += b;
 	}
 
+	transcoded = stats.paths[PATH_BRIDGE] + stats.paths[PATH_RESAMPLE];
+
+	err |= re_hprintf(pf, "{\"sessions\":{\"active\":%u,"
+			  "\"total\":%llu,\"established\":%llu,"
+			  "\"failed\":%llu,\"rate\":%.2f},",
+			  stats.active, stats.sessions, stats.established,
+			  stats.failed, stats_rate());
+	err |= re_hprintf(pf, "\"setup_ms\":{\"min\":%llu,\"avg\":%llu,"
+			  "\"max\":%llu,\"p50\":%llu,\"p90\":%llu,"
+			  "\"p99\":%llu},",
+			  stats.setup_min,
+			  stats.established ?
+			  stats.setup_sum / stats.established : 0,
+			  stats.setup_max, stats_percentile(50),
+			  stats_percentile(90), stats_percentile(99));
+	err |= re_hprintf(pf, "\"media\":{\"packets\":%llu,"
+			  "\"bytes\":%llu},",
+			  npkts, nbytes);
+	err |= re_hprintf(pf, "\"paths\":{\"relay\":%llu,"
+			  "\"pcm-bridge\":%llu,\"resample-bridge\":%llu,"
+			  "\"transcoded_ratio\":%.3f}}\n",
+			  stats.paths[PATH_RELAY], stats.paths[PATH_BRIDGE],
+			  stats.paths[PATH_RESAMPLE],
+			  stats.established ?
+			  (double)transcoded / stats.established : 0.0);
+
 	return err;
 }
 
 
+static int b2bua_session(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	const struct session *sess;
+
+	if (!str_isset(carg->prm))
+		return re_hprintf(pf, "usage: /b2bua_session <call-id>\n");
+
+	sess = session_find(carg->prm);
+	if (!sess)
+		return re_hprintf(pf, "b2bua: session not found: %s\n",
+				  carg->prm);
+
+	return session_debug(pf, sess);
+}
+
+
+static int b2bua_kill(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct session *sess;
+
+	if (!str_isset(carg->prm))
+		return re_hprintf(pf, "usage: /b2bua_kill <call-id>\n");
+
+	sess = session_find(carg->prm);
+	if (!sess)
+		return re_hprintf(pf, "b2bua: session not found: %s\n",
+				  carg->prm);
+
+	info("b2bua: killing session (in=%s, out=%s)\n",
+	     call_id(sess->call_in), call_id(sess->call_out));
+
+	call_hangup(sess->call_in, 0, NULL);
+	call_hangup(sess->call_out, 0, NULL);
+	mem_deref(sess);
+
+	return 0;
+}
+
+
 static const struct cmd cmdv[] = {
-	{"b2bua", 0,       0, "b2bua status", b2bua_status },
+	{"b2bua",         0,       0, "b2bua status",       b2bua_status  },
+	{"b2bua_kill",    0, CMD_PRM, "Kill b2bua session", b2bua_kill    },
+	{"b2bua_session", 0, CMD_PRM, "Show b2bua session", b2bua_session },
+	{"b2bua_stats",   0,       0, "b2bua statistics",   b2bua_stats   },
 };
 
 
 static int module_init(void)
 {
+	struct account *acc;
+	uint32_t nthreads = 0;
 	int err;
 
 	ua_in  = uag_find_param("b2bua", "inbound");
@@ -207,6 +784,28 @@ static int module_init(void)
 		return ENOENT;
 	}
 
+	(void)conf_get_bool(conf_cur(), "b2bua_relay", &relay_enabled);
+	(void)conf_get_bool(conf_cur(), "b2bua_passthrough", &passthrough);
+	(void)conf_get_u32(conf_cur(), "b2bua_threads", &nthreads);
+	(void)conf_get_bool(conf_cur(), "b2bua_dtmf_relay", &dtmf_relay);
+
+	/* an empty codec list selects the global audio codecs */
+	acc = ua_account(ua_out);
+	if (account_aucodecl(acc) != baresip_aucodecl()) {
+		err = re_sdprintf(&acc_codecs, "%H", aucodecl_print,
+				  account_aucodecl(acc));
+		if (err)
+			return err;
+	}
+
+	err = hash_alloc(&sessionh, SESSION_HASH_SIZE);
+	if (err)
+		return err;
+
+	err = shard_init(nthreads);
+	if (err)
+		return err;
+
 	err = cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 	if (err)
 		return err;
@@ -234,6 +833,10 @@ static int module_close(void)
 		list_flush(&sessionl);
 	}
 
+	shard_close();
+	sessionh = mem_deref(sessionh);
+	acc_codecs = mem_deref(acc_codecs);
+
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
 
@@ -0,0 +1,34 @@
+/**
+ * @file b2bua.h B2BUA module internal interface
+ *
+ * Copyright (C) 2010 Alfred E. Heggestad
+ */
+
+
+/* RTP relay */
+struct relay;
+struct shard;
+struct shard_sock;
+
+/** Packets that are relayed */
+enum relay_mode {
+	RELAY_MEDIA,      /**< All RTP packets of negotiated formats     */
+	RELAY_EVENTS,     /**< RFC 4733 telephone-events only            */
+};
+
+int relay_alloc(struct relay **rlp, struct call *call_a, struct call *call_b,
+		struct shard *sh, enum relay_mode mode);
+int relay_debug(struct re_printf *pf, const struct relay *rl);
+void relay_stats(const struct relay *rl, uint64_t *npkts, uint64_t *nbytes);
+void relay_update(struct relay *rl);
+void relay_close(struct relay *rl);
+
+
+/* Media threads */
+int  shard_init(uint32_t n);
+void shard_close(void);
+struct shard *shard_get(const char *id);
+int  shard_attach(struct shard_sock **ssp, struct shard *sh,
+		  struct udp_sock *us);
+void shard_detach(struct shard_sock *ss, void *ref);
+int  shard_debug(struct re_printf *pf, void *unused);
@@ -0,0 +1,628 @@
+/**
+ * @file relay.c B2BUA packet-level RTP relay
+ *
+ * Copyright (C) 2026 Alfred E. Heggestad
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+
+#include "b2bua.h"
+
+
+/**
+ * The relay forwards the RTP packets received on one call leg to the other
+ * call leg without decoding. A UDP helper on each leg's RTP socket consumes
+ * the received packets and sends them on the socket of the other leg. Only
+ * the payload type, SSRC, sequence number and timestamp are rewritten.
+ * RTCP and packets with payload types that are not negotiated on both legs
+ * are passed to the audio stream as usual.
+ *
+ * The relayed packets get the SSRC of the local stream of the sending leg,
+ * so that its RTCP refers to the same source. The stream does not see the
+ * relayed packets, so its RTCP carries no sender report and no reception
+ * report for them. The remote address and direction of each leg are read
+ * again from the SDP on re-INVITE, UPDATE and hold, and nothing is sent to
+ * a leg that does not receive. The payload type mapping is kept.
+ *
+ * If the relay runs on a media thread, the sockets of both legs are moved
+ * to that thread and the other packets are dropped, since the audio
+ * stream must only be used from the main thread. The packet counters are
+ * updated on the media thread and read on the main thread. A relay on a
+ * media thread must be released with relay_close(), which moves the
+ * sockets back to the main thread and keeps the relay until then.
+ *
+ * In event mode only RFC 4733 telephone-events are relayed, while the audio
+ * of the legs is bridged by the audio streams. The events are inserted
+ * into the RTP stream that is sent on the other leg: they get the SSRC of
+ * the local stream, the next sequence number, and a timestamp that maps
+ * the start of the event to the local timestamp clock. The timestamp is
+ * extrapolated with the RTP clock rate of the local audio codec, which
+ * may differ from the telephone-event rate. CSRC list and header
+ * extension of the received event are removed, since the extension IDs
+ * are negotiated per leg. The sequence numbers of the locally encoded
+ * packets are shifted by the number of inserted packets, and local audio
+ * is dropped while an event is active.
+ * The send helper runs in the audio transmit thread, so the state of the
+ * local stream is protected by a mutex.
+ */
+
+
+enum {
+	LAYER_RELAY  = 10,       /**< UDP helper layer                     */
+	RTP_VERSION  = 2,        /**< RTP version                          */
+	RTP_HDR_SIZE = 12,       /**< Fixed RTP header size                */
+	PT_MAX       = 128,      /**< Number of RTP payload types          */
+	PT_NONE      = 0xff,     /**< Payload type is not relayed          */
+	TEV_SIZE     = 4,        /**< RFC 4733 event payload size          */
+	TEV_TIMEOUT  = 1000,     /**< Event end timeout [ms]               */
+};
+
+
+/** One call leg of the relay, rewrites the packets it receives  */
+struct relay_leg {
+	struct relay_leg *other; /**< Other call leg                       */
+	const struct relay *rl;  /**< Parent relay                         */
+	struct udp_sock *us;     /**< RTP socket of this leg               */
+	struct udp_helper *uh;   /**< UDP helper on the RTP socket         */
+	const struct audio *au;  /**< Audio object of this leg             */
+	const struct stream *strm; /**< Audio stream of this leg           */
+	struct sa raddr;         /**< Remote RTP address (locked), or unset */
+	uint8_t ptmap[PT_MAX];   /**< Received PT to PT of the other leg   */
+	uint32_t ssrc;           /**< SSRC of the relayed packets          */
+	uint16_t seq_offs;       /**< Sequence number offset               */
+	uint32_t ts_offs;        /**< Timestamp offset                     */
+	bool sending;            /**< Relayed packet is being sent         */
+	struct shard_sock *ss;   /**< Socket on the shard, if any          */
+	RE_ATOMIC uint64_t npkts;    /**< Number of relayed packets        */
+	RE_ATOMIC uint64_t nbytes;   /**< Number of relayed bytes          */
+
+	/* event mode, state of the local stream sent on this leg */
+	RE_ATOMIC bool inserting;    /**< Inserted event is being sent     */
+	uint8_t tev_pt;          /**< Telephone-event PT sent on this leg  */
+	uint32_t tx_srate;       /**< RTP clock rate of the local audio    */
+	bool tx;                 /**< Local packet has been sent           */
+	uint32_t tx_ssrc;        /**< SSRC of the local stream             */
+	uint16_t tx_seq;         /**< Last sent sequence number            */
+	uint32_t tx_ts;          /**< Last sent timestamp                  */
+	uint64_t tx_time;        /**< Time of the last local packet [ms]   */
+	uint16_t tx_shift;       /**< Number of inserted packets           */
+	bool ev;                 /**< An event has been inserted           */
+	bool ev_active;          /**< Event is active, drop local audio    */
+	uint32_t ev_src_ts;      /**< Received timestamp of the event      */
+	uint32_t ev_ts;          /**< Sent timestamp of the event          */
+	uint64_t ev_time;        /**< Time of the last event packet [ms]   */
+};
+
+
+struct relay {
+	struct relay_leg a;
+	struct relay_leg b;
+	struct shard *shard;     /**< Media thread, NULL for main thread   */
+	enum relay_mode mode;    /**< Relayed packets                      */
+	mtx_t *mtx;              /**< Protects raddr and the stream state  */
+	RE_ATOMIC bool stopped;  /**< Drop all packets until detached      */
+};
+
+
+static void destructor(void *arg)
+{
+	struct relay *rl = arg;
+
+	mem_deref(rl->a.uh);
+	mem_deref(rl->b.uh);
+	mem_deref(rl->a.ss);
+	mem_deref(rl->b.ss);
+	mem_deref(rl->mtx);
+}
+
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8  | (uint32_t)p[3];
+}
+
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+
+static inline void put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+
+static bool is_rtp(const struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+
+	if (mbuf_get_left(mb) < RTP_HDR_SIZE)
+		return false;
+
+	if ((p[0] >> 6) != RTP_VERSION)
+		return false;
+
+	return !rtp_pt_is_rtcp(p[1] & 0x7f);
+}
+
+
+/* Get the RTP header size including CSRC list and extension, 0 if invalid */
+static size_t rtp_hdr_size(const uint8_t *p, size_t len)
+{
+	size_t hlen = RTP_HDR_SIZE + (p[0] & 0x0f) * 4;
+
+	if (!(p[0] & 0x10))
+		return hlen <= len ? hlen : 0;
+
+	if (hlen + 4 > len)
+		return 0;
+
+	hlen += 4 + get_u16(&p[hlen + 2]) * 4;
+
+	return hlen <= len ? hlen : 0;
+}
+
+
+/*
+ * Insert a received telephone-event packet into the local stream of the
+ * other leg. Returns false to pass the packet to the audio stream if no
+ * local packet was sent on the other leg yet.
+ */
+static bool event_insert(struct relay_leg *leg, struct mbuf *mb)
+{
+	struct relay_leg *other = leg->other;
+	size_t len = mbuf_get_left(mb);
+	uint8_t *p = mbuf_buf(mb);
+	uint64_t now = tmr_jiffies();
+	struct sa dst;
+	uint32_t src_ts;
+	size_t hlen;
+	int err;
+
+	hlen = rtp_hdr_size(p, len);
+	if (!hlen || len < hlen + TEV_SIZE)
+		return false;
+
+	src_ts = get_u32(&p[4]);
+
+	mtx_lock(leg->rl->mtx);
+
+	if (!other->tx) {
+		mtx_unlock(leg->rl->mtx);
+		return false;
+	}
+
+	/* a new event starts at the current local timestamp */
+	if (!other->ev || src_ts != other->ev_src_ts) {
+		other->ev        = true;
+		other->ev_src_ts = src_ts;
+		other->ev_ts     = other->tx_ts + (uint32_t)
+			((now - other->tx_time) * other->tx_srate / 1000);
+	}
+
+	other->ev_active = !(p[hlen + 1] & 0x80);
+	other->ev_time   = now;
+	++other->tx_seq;
+	++other->tx_shift;
+
+	/* move the fixed header in front of the event payload */
+	if (hlen > RTP_HDR_SIZE) {
+		memmove(p + hlen - RTP_HDR_SIZE, p, RTP_HDR_SIZE);
+		mbuf_advance(mb, (ssize_t)(hlen - RTP_HDR_SIZE));
+		len -= hlen - RTP_HDR_SIZE;
+		p    = mbuf_buf(mb);
+		p[0] &= 0xe0;
+	}
+
+	p[1] = (p[1] & 0x80) | other->tev_pt;
+	put_u16(&p[2], other->tx_seq);
+	put_u32(&p[4], other->ev_ts);
+	put_u32(&p[8], other->tx_ssrc);
+	dst = other->raddr;
+
+	mtx_unlock(leg->rl->mtx);
+
+	if (!sa_isset(&dst, SA_ALL))
+		return true;
+
+	re_atomic_rlx_set(&other->inserting, true);
+	err = udp_send(other->us, &dst, mb);
+	re_atomic_rlx_set(&other->inserting, false);
+
+	if (!err) {
+		re_atomic_rlx_add(&leg->npkts, 1);
+		re_atomic_rlx_add(&leg->nbytes, len);
+	}
+
+	return true;
+}
+
+
+/*
+ * Track the local stream of a leg in event mode. Sequence numbers are
+ * shifted by the number of inserted packets.
+ */
+static bool event_send(struct relay_leg *leg, int *err, struct mbuf *mb)
+{
+	uint8_t *p = mbuf_buf(mb);
+	uint64_t now = tmr_jiffies();
+	bool drop = false;
+
+	if ((p[1] & 0x7f) == leg->tev_pt &&
+	    re_atomic_rlx(&leg->inserting))
+		return false;
+
+	mtx_lock(leg->rl->mtx);
+
+	if (leg->ev_active && now - leg->ev_time < TEV_TIMEOUT) {
+		drop = true;
+	}
+	else {
+		leg->ev_active = false;
+		leg->tx        = true;
+		leg->tx_seq    = get_u16(&p[2]) + leg->tx_shift;
+		leg->tx_ts     = get_u32(&p[4]);
+		leg->tx_ssrc   = get_u32(&p[8]);
+		leg->tx_time   = now;
+
+		put_u16(&p[2], leg->tx_seq);
+	}
+
+	mtx_unlock(leg->rl->mtx);
+
+	if (drop)
+		*err = 0;
+
+	return drop;
+}
+
+
+static bool recv_handler(struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct relay_leg *leg = arg;
+	struct relay_leg *other = leg->other;
+	size_t len = mbuf_get_left(mb);
+	uint8_t *p = mbuf_buf(mb);
+	struct sa dst;
+	uint8_t pt;
+	int err;
+	(void)src;
+
+	/* the socket is about to be moved back to the main thread */
+	if (re_atomic_rlx(&leg->rl->stopped))
+		return true;
+
+	if (!is_rtp(mb))
+		return leg->rl->shard != NULL;
+
+	pt = p[1] & 0x7f;
+	if (leg->ptmap[pt] == PT_NONE)
+		return leg->rl->shard != NULL;
+
+	if (leg->rl->mode == RELAY_EVENTS)
+		return event_insert(leg, mb);
+
+	p[1] = (p[1] & 0x80) | leg->ptmap[pt];
+	put_u16(&p[2], get_u16(&p[2]) + leg->seq_offs);
+	put_u32(&p[4], get_u32(&p[4]) + leg->ts_offs);
+	put_u32(&p[8], leg->ssrc);
+
+	mtx_lock(leg->rl->mtx);
+	dst = other->raddr;
+	mtx_unlock(leg->rl->mtx);
+
+	/* the other leg is on hold */
+	if (!sa_isset(&dst, SA_ALL))
+		return true;
+
+	other->sending = true;
+	err = udp_send(other->us, &dst, mb);
+	other->sending = false;
+
+	if (!err) {
+		re_atomic_rlx_add(&leg->npkts, 1);
+		re_atomic_rlx_add(&leg->nbytes, len);
+	}
+
+	return true;
+}
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct relay_leg *leg = arg;
+	(void)dst;
+
+	if (!is_rtp(mb))
+		return false;
+
+	if (leg->rl->mode == RELAY_EVENTS)
+		return event_send(leg, err, mb);
+
+	if (leg->sending)
+		return false;
+
+	/* the relay owns the RTP stream, drop locally encoded packets */
+	*err = 0;
+	return true;
+}
+
+
+static const struct sdp_format *format_find(const struct list *lst,
+					    const struct sdp_format *f)
+{
+	struct le *le;
+
+	for (le = list_head(lst); le; le = le->next) {
+		const struct sdp_format *fmt = le->data;
+
+		if (fmt->srate == f->srate && fmt->ch == f->ch &&
+		    !str_casecmp(fmt->name, f->name))
+			return fmt;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Packets are received with the payload types of the local SDP and sent
+ * with the payload types of the other leg's remote SDP
+ */
+static void ptmap_init(struct relay_leg *leg, const struct sdp_media *rx,
+		       const struct sdp_media *tx, enum relay_mode mode)
+{
+	const struct list *txl = sdp_media_format_lst(tx, false);
+	struct le *le;
+
+	memset(leg->ptmap, PT_NONE, sizeof(leg->ptmap));
+
+	for (le = list_head(sdp_media_format_lst(rx, true)); le;
+	     le = le->next) {
+		const struct sdp_format *fmt = le->data;
+		const struct sdp_format *txfmt;
+
+		if (fmt->pt < 0 || fmt->pt >= PT_MAX)
+			continue;
+
+		if (mode == RELAY_EVENTS &&
+		    str_casecmp(fmt->name, "telephone-event"))
+			continue;
+
+		txfmt = format_find(txl, fmt);
+		if (txfmt && txfmt->pt >= 0 && txfmt->pt < PT_MAX)
+			leg->ptmap[fmt->pt] = (uint8_t)txfmt->pt;
+	}
+}
+
+
+/* Read the RTP clock rate of the audio codec sent on a leg */
+static void leg_srate(struct relay_leg *leg)
+{
+	const struct aucodec *ac = audio_codec(leg->au, true);
+
+	if (!ac)
+		return;
+
+	mtx_lock(leg->rl->mtx);
+	leg->tx_srate = ac->crate ? ac->crate : ac->srate;
+	mtx_unlock(leg->rl->mtx);
+}
+
+
+/* Read the remote address of a leg, unset if the leg does not receive */
+static void leg_raddr(struct relay_leg *leg)
+{
+	const struct sdp_media *m = stream_sdpmedia(leg->strm);
+	const struct sa *raddr = sdp_media_raddr(m);
+
+	mtx_lock(leg->rl->mtx);
+
+	if (sa_isset(raddr, SA_ALL) && (sdp_media_dir(m) & SDP_SENDONLY))
+		sa_cpy(&leg->raddr, raddr);
+	else
+		sa_init(&leg->raddr, AF_UNSPEC);
+
+	mtx_unlock(leg->rl->mtx);
+}
+
+
+static int leg_init(struct relay *rl, struct relay_leg *leg,
+		    struct relay_leg *other,
+		    const struct call *call, const struct call *ocall)
+{
+	const struct stream *strm  = audio_strm(call_audio(call));
+	const struct stream *ostrm = audio_strm(call_audio(ocall));
+	const struct sdp_format *tev;
+	const struct sa *raddr;
+	unsigned pt;
+	int err;
+
+	leg->rl    = rl;
+	leg->other = other;
+	leg->au    = call_audio(call);
+	leg->strm  = strm;
+	leg->us    = rtp_sock(stream_rtp_sock(strm));
+	raddr      = sdp_media_raddr(stream_sdpmedia(strm));
+	if (!leg->us || !sa_isset(raddr, SA_ALL))
+		return EINVAL;
+
+	leg_raddr(leg);
+	leg->ssrc     = rtp_sess_ssrc(stream_rtp_sock(ostrm));
+	leg->seq_offs = rand_u16();
+	leg->ts_offs  = rand_u32();
+	ptmap_init(leg, stream_sdpmedia(strm), stream_sdpmedia(ostrm),
+		   rl->mode);
+
+	if (rl->mode == RELAY_EVENTS) {
+		tev = sdp_media_rformat(stream_sdpmedia(strm),
+					"telephone-event");
+		if (!tev || tev->pt < 0 || tev->pt >= PT_MAX)
+			return ENOENT;
+
+		for (pt = 0; pt < PT_MAX; pt++) {
+			if (leg->ptmap[pt] != PT_NONE)
+				break;
+		}
+		if (pt == PT_MAX)
+			return ENOENT;
+
+		leg_srate(leg);
+		if (!leg->tx_srate)
+			return ENOENT;
+
+		leg->tev_pt = (uint8_t)tev->pt;
+	}
+
+	err = udp_register_helper(&leg->uh, leg->us, LAYER_RELAY,
+				  send_handler, recv_handler, leg);
+	if (err || !rl->shard)
+		return err;
+
+	return shard_attach(&leg->ss, rl->shard, leg->us);
+}
+
+
+/**
+ * Allocate an RTP relay between the audio streams of two calls
+ *
+ * @param rlp     Pointer to allocated relay
+ * @param call_a  First call leg
+ * @param call_b  Second call leg
+ * @param sh      Media thread, or NULL to relay on the main thread
+ * @param mode    Relay all media or only telephone-events
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int relay_alloc(struct relay **rlp, struct call *call_a, struct call *call_b,
+		struct shard *sh, enum relay_mode mode)
+{
+	struct relay *rl;
+	int err;
+
+	if (!rlp || !call_a || !call_b)
+		return EINVAL;
+
+	rl = mem_zalloc(sizeof(*rl), destructor);
+	if (!rl)
+		return ENOMEM;
+
+	rl->mode = mode;
+
+	/* the audio streams of the legs are used from the main thread */
+	if (mode == RELAY_MEDIA)
+		rl->shard = sh;
+
+	err = mutex_alloc(&rl->mtx);
+	if (err)
+		goto out;
+
+	err = leg_init(rl, &rl->a, &rl->b, call_a, call_b);
+	if (err)
+		goto out;
+
+	err = leg_init(rl, &rl->b, &rl->a, call_b, call_a);
+
+ out:
+	if (err)
+		relay_close(rl);
+	else
+		*rlp = rl;
+
+	return err;
+}
+
+
+int relay_debug(struct re_printf *pf, const struct relay *rl)
+{
+	if (!rl)
+		return 0;
+
+	return re_hprintf(pf, "%s: in->out %llu packets %llu bytes, "
+			  "out->in %llu packets %llu bytes",
+			  rl->mode == RELAY_EVENTS ? "event relay" : "relay",
+			  re_atomic_rlx(&rl->a.npkts),
+			  re_atomic_rlx(&rl->a.nbytes),
+			  re_atomic_rlx(&rl->b.npkts),
+			  re_atomic_rlx(&rl->b.nbytes));
+}
+
+
+/**
+ * Get the number of relayed packets and bytes in both directions
+ *
+ * @param rl      RTP relay
+ * @param npkts   Returns the number of packets
+ * @param nbytes  Returns the number of bytes
+ */
+void relay_stats(const struct relay *rl, uint64_t *npkts, uint64_t *nbytes)
+{
+	if (!rl)
+		return;
+
+	if (npkts) {
+		*npkts = re_atomic_rlx(&rl->a.npkts) +
+			 re_atomic_rlx(&rl->b.npkts);
+	}
+	if (nbytes) {
+		*nbytes = re_atomic_rlx(&rl->a.nbytes) +
+			  re_atomic_rlx(&rl->b.nbytes);
+	}
+}
+
+
+/**
+ * Update the remote addresses and clock rates of the legs after a new
+ * remote SDP
+ *
+ * @param rl  RTP relay
+ */
+void relay_update(struct relay *rl)
+{
+	if (!rl)
+		return;
+
+	leg_raddr(&rl->a);
+	leg_raddr(&rl->b);
+
+	if (rl->mode == RELAY_EVENTS) {
+		leg_srate(&rl->a);
+		leg_srate(&rl->b);
+	}
+}
+
+
+/**
+ * Stop and release an RTP relay. The sockets of a relay on a media thread
+ * are moved back to the main thread asynchronously, and the relay is
+ * released when that is done.
+ *
+ * @param rl  RTP relay
+ */
+void relay_close(struct relay *rl)
+{
+	if (!rl)
+		return;
+
+	re_atomic_rlx_set(&rl->stopped, true);
+
+	shard_detach(rl->a.ss, rl);
+	shard_detach(rl->b.ss, rl);
+
+	mem_deref(rl);
+}
@@ -0,0 +1,440 @@
+/**
+ * @file shard.c B2BUA media threads
+ *
+ * Copyright (C) 2026 Alfred E. Heggestad
+ */
+#include <re.h>
+#include <baresip.h>
+
+#include "b2bua.h"
+
+
+/**
+ * Each shard is a thread with its own re event loop. The RTP sockets of a
+ * relayed session are moved to the event loop of one shard, selected by
+ * the hash of the inbound Call-ID, so that packet relaying of different
+ * sessions runs in parallel. SIP signaling and the call objects stay on
+ * the main thread.
+ *
+ * Requests are sent to a shard via its message queue, and the main thread
+ * does not wait for them. A handled request is returned to the main
+ * thread, which moves a detached socket back to its own event loop and
+ * releases the references of the request. Since the requests of a shard
+ * are handled in order, a socket is never polled by two threads, and
+ * memory references are only taken and released on the main thread.
+ */
+
+
+enum shard_msg {
+	SHARD_ATTACH,
+	SHARD_DETACH,
+	SHARD_STOP,
+};
+
+
+struct shard {
+	thrd_t tid;
+	struct mqueue *mq;       /**< Requests from the main thread        */
+	mtx_t mtx;
+	cnd_t cnd;
+	bool ready;              /**< Event loop of the thread is running  */
+	int err;                 /**< Thread startup error                 */
+	RE_ATOMIC uint32_t nsocks; /**< Number of attached sockets         */
+};
+
+
+/** UDP socket that is attached to a shard  */
+struct shard_sock {
+	struct shard *sh;
+	struct udp_sock *us;
+	bool attached;           /**< Polled by the shard (shard thread)   */
+};
+
+
+/** Request to a shard, returned to the main thread when handled  */
+struct shard_req {
+	struct le le;
+	struct shard_sock *ss;
+	void *ref;               /**< Released on the main thread          */
+	enum shard_msg msg;
+	bool back;               /**< Socket must be attached on main      */
+	int err;
+};
+
+
+static struct {
+	struct shard *shardv;
+	uint32_t n;
+	struct mqueue *mq;       /**< Wakes up the main thread             */
+	mtx_t *mtx;              /**< Protects the handled requests        */
+	struct list done;        /**< Handled requests (shard_req)         */
+} d;
+
+
+static void sock_destructor(void *arg)
+{
+	struct shard_sock *ss = arg;
+
+	mem_deref(ss->us);
+}
+
+
+static void req_destructor(void *arg)
+{
+	struct shard_req *req = arg;
+
+	mem_deref(req->ref);
+	mem_deref(req->ss);
+}
+
+
+static int req_push(struct shard_sock *ss, enum shard_msg msg, void *ref)
+{
+	struct shard_req *req;
+	int err;
+
+	req = mem_zalloc(sizeof(*req), req_destructor);
+	if (!req)
+		return ENOMEM;
+
+	req->ss  = mem_ref(ss);
+	req->ref = mem_ref(ref);
+	req->msg = msg;
+
+	err = mqueue_push(ss->sh->mq, msg, req);
+	if (err)
+		mem_deref(req);
+
+	return err;
+}
+
+
+/* Main thread: finish the requests that were handled by the shards */
+static void req_finish(void)
+{
+	for (;;) {
+		struct shard_req *req;
+		struct le *le;
+
+		mtx_lock(d.mtx);
+		le = list_head(&d.done);
+		list_unlink(le);
+		mtx_unlock(d.mtx);
+
+		if (!le)
+			break;
+
+		req = le->data;
+
+		if (req->err) {
+			warning("b2bua: media thread could not attach "
+				"socket (%m)\n", req->err);
+		}
+
+		if (req->back)
+			(void)udp_thread_attach(req->ss->us);
+
+		mem_deref(req);
+	}
+}
+
+
+static void done_handler(int id, void *data, void *arg)
+{
+	(void)id;
+	(void)data;
+	(void)arg;
+
+	req_finish();
+}
+
+
+/* Shard thread: return a handled request to the main thread */
+static void req_done(struct shard_req *req)
+{
+	mtx_lock(d.mtx);
+	list_append(&d.done, &req->le, req);
+	mtx_unlock(d.mtx);
+
+	(void)mqueue_push(d.mq, 0, NULL);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct shard *sh = arg;
+	struct shard_req *req = data;
+	struct shard_sock *ss;
+
+	switch (id) {
+
+	case SHARD_ATTACH:
+		ss = req->ss;
+		req->err = udp_thread_attach(ss->us);
+		if (req->err) {
+			req->back = true;
+			break;
+		}
+
+		ss->attached = true;
+		re_atomic_rlx_add(&sh->nsocks, 1);
+		break;
+
+	case SHARD_DETACH:
+		ss = req->ss;
+		if (!ss->attached)
+			break;
+
+		udp_thread_detach(ss->us);
+		ss->attached = false;
+		re_atomic_rlx_sub(&sh->nsocks, 1);
+		req->back = true;
+		break;
+
+	case SHARD_STOP:
+		re_cancel();
+		return;
+
+	default:
+		return;
+	}
+
+	req_done(req);
+}
+
+
+static int shard_thread(void *arg)
+{
+	struct shard *sh = arg;
+	int err;
+
+	err = re_thread_init();
+	if (err)
+		goto out;
+
+	err = mqueue_alloc(&sh->mq, mqueue_handler, sh);
+
+ out:
+	mtx_lock(&sh->mtx);
+	sh->err   = err;
+	sh->ready = true;
+	cnd_broadcast(&sh->cnd);
+	mtx_unlock(&sh->mtx);
+
+	if (!err)
+		(void)re_main(NULL);
+
+	sh->mq = mem_deref(sh->mq);
+	re_thread_close();
+
+	return err;
+}
+
+
+static int shard_start(struct shard *sh)
+{
+	int err;
+
+	if (mtx_init(&sh->mtx, mtx_plain) != thrd_success)
+		return ENOMEM;
+
+	if (cnd_init(&sh->cnd) != thrd_success) {
+		mtx_destroy(&sh->mtx);
+		return ENOMEM;
+	}
+
+	err = thread_create_name(&sh->tid, "b2bua", shard_thread, sh);
+	if (err) {
+		cnd_destroy(&sh->cnd);
+		mtx_destroy(&sh->mtx);
+		return err;
+	}
+
+	mtx_lock(&sh->mtx);
+	while (!sh->ready)
+		cnd_wait(&sh->cnd, &sh->mtx);
+	mtx_unlock(&sh->mtx);
+
+	if (sh->err) {
+		thrd_join(sh->tid, NULL);
+		cnd_destroy(&sh->cnd);
+		mtx_destroy(&sh->mtx);
+	}
+
+	return sh->err;
+}
+
+
+static void shard_stop(struct shard *sh)
+{
+	if (sh->mq)
+		(void)mqueue_push(sh->mq, SHARD_STOP, NULL);
+
+	thrd_join(sh->tid, NULL);
+	cnd_destroy(&sh->cnd);
+	mtx_destroy(&sh->mtx);
+}
+
+
+/**
+ * Start the media threads
+ *
+ * @param n  Number of threads, 0 to relay media on the main thread
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shard_init(uint32_t n)
+{
+	uint32_t i;
+	int err = 0;
+
+	if (!n)
+		return 0;
+
+	err = mutex_alloc(&d.mtx);
+	if (err)
+		return err;
+
+	err = mqueue_alloc(&d.mq, done_handler, NULL);
+	if (err)
+		goto out;
+
+	d.shardv = mem_zalloc(n * sizeof(*d.shardv), NULL);
+	if (!d.shardv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		err = shard_start(&d.shardv[i]);
+		if (err) {
+			warning("b2bua: media thread %u failed (%m)\n",
+				i, err);
+			break;
+		}
+
+		++d.n;
+	}
+
+ out:
+	if (err)
+		shard_close();
+
+	return err;
+}
+
+
+/**
+ * Stop all media threads. The sockets that are still detached from a
+ * shard are moved back to the main thread.
+ */
+void shard_close(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < d.n; i++)
+		shard_stop(&d.shardv[i]);
+
+	if (d.mtx)
+		req_finish();
+
+	d.shardv = mem_deref(d.shardv);
+	d.n = 0;
+	d.mq  = mem_deref(d.mq);
+	d.mtx = mem_deref(d.mtx);
+}
+
+
+/**
+ * Get the shard of a session
+ *
+ * @param id  Call-ID of the inbound leg
+ *
+ * @return Shard, or NULL if media is relayed on the main thread
+ */
+struct shard *shard_get(const char *id)
+{
+	if (!d.n)
+		return NULL;
+
+	return &d.shardv[hash_fast_str(id) % d.n];
+}
+
+
+/**
+ * Move a UDP socket from the main thread to a shard. The socket is
+ * attached asynchronously, and is moved back to the main thread if that
+ * fails.
+ *
+ * @param ssp  Pointer to allocated shard socket
+ * @param sh   Shard
+ * @param us   UDP socket
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shard_attach(struct shard_sock **ssp, struct shard *sh,
+		 struct udp_sock *us)
+{
+	struct shard_sock *ss;
+	int err;
+
+	if (!ssp || !sh || !us)
+		return EINVAL;
+
+	ss = mem_zalloc(sizeof(*ss), sock_destructor);
+	if (!ss)
+		return ENOMEM;
+
+	ss->sh = sh;
+	ss->us = mem_ref(us);
+
+	udp_thread_detach(us);
+
+	err = req_push(ss, SHARD_ATTACH, NULL);
+	if (err) {
+		(void)udp_thread_attach(us);
+		mem_deref(ss);
+		return err;
+	}
+
+	*ssp = ss;
+
+	return 0;
+}
+
+
+/**
+ * Move a UDP socket from a shard back to the main thread, without
+ * waiting for the shard. The socket handlers may be called on the shard
+ * until it is detached, so the given object is referenced until then.
+ *
+ * @param ss   Shard socket
+ * @param ref  Object that is referenced until the socket is detached
+ */
+void shard_detach(struct shard_sock *ss, void *ref)
+{
+	if (!ss)
+		return;
+
+	if (req_push(ss, SHARD_DETACH, ref))
+		warning("b2bua: could not detach socket from media thread\n");
+}
+
+
+int shard_debug(struct re_printf *pf, void *unused)
+{
+	uint32_t i;
+	int err = 0;
+	(void)unused;
+
+	if (!d.n)
+		return re_hprintf(pf, "media threads: none\n");
+
+	err |= re_hprintf(pf, "media threads: %u\n", d.n);
+	for (i = 0; i < d.n; i++) {
+		err |= re_hprintf(pf, "  #%u: %u sockets\n", i,
+				  re_atomic_rlx(&d.shardv[i].nsocks));
+	}
+
+	return err;
+}
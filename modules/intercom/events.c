@@ -8,9 +8,11 @@
 #include <stdlib.h>
 #include <re.h>
 #include <baresip.h>
+#include <accextra.h>
 
 #include "iccustom.h"
 #include "ichidden.h"
+#include "icbatch.h"
 #include "intercom.h"
 
 static int reject_call(struct call *call, uint16_t scode, const char *reason)
@@ -22,87 +24,181 @@ static int reject_call(struct call *call, uint16_t scode, const char *reason)
 }
 
 
-static bool is_normal(const struct pl *val)
+/** Intercom call types, classified by the Subject header  */
+enum ic_type {
+	IC_NONE = 0,
+	IC_NORMAL,
+	IC_ANNOUNCE,
+	IC_FORCE,
+	IC_SURVEIL,
+	IC_HIDDEN,
+	IC_PREVIEW,
+	IC_CUSTOM,
+};
+
+
+/** Intercom policy  */
+struct ic_policy {
+	bool privacy;
+	bool allow_announce;
+	bool allow_force;
+	bool allow_surveil;
+	bool allow_hidden;
+};
+
+
+/** Cached configuration, reloaded by /icreload  */
+static struct {
+	char preview[64];         /**< Preview Subject prefix              */
+	size_t previewlen;
+	struct ic_policy policy;  /**< Default policy                      */
+	struct accextra_cache accx;  /**< Policy per account            */
+} icc;
+
+
+/**
+ * Parse the intercom policy of an account
+ *
+ * The account extra parameters override the configured defaults.
+ *
+ * @param acc  Account
+ *
+ * @return Policy object
+ */
+static void *ic_policy_parse(const struct account *acc)
 {
-	return !pl_strcmp(val, "normal");
+	struct ic_policy *pol;
+
+	pol = mem_zalloc(sizeof(*pol), NULL);
+	if (!pol)
+		return NULL;
+
+	*pol = icc.policy;
+	(void)account_extra_bool(acc, "icprivacy", &pol->privacy);
+	(void)account_extra_bool(acc, "icallow_announce",
+				 &pol->allow_announce);
+	(void)account_extra_bool(acc, "icallow_force", &pol->allow_force);
+	(void)account_extra_bool(acc, "icallow_surveil",
+				 &pol->allow_surveil);
+	(void)account_extra_bool(acc, "icallow_hidden", &pol->allow_hidden);
+
+	return pol;
 }
 
 
-static bool is_announcement(const struct pl *val)
+static const struct ic_policy *ic_policy(struct account *acc)
 {
-	return !pl_strcmp(val, "announcement");
+	const struct ic_policy *pol = accextra_get(&icc.accx, acc);
+
+	return pol ? pol : &icc.policy;
 }
 
 
-static bool is_forcetalk(const struct pl *val)
+void events_conf_load(void)
 {
-	return !pl_strcmp(val, "forcetalk");
+	struct ic_policy *p = &icc.policy;
+
+	str_ncpy(icc.preview, "preview", sizeof(icc.preview));
+	(void)conf_get_str(conf_cur(), "icpreview_subject", icc.preview,
+			   sizeof(icc.preview));
+	icc.previewlen = str_len(icc.preview);
+
+	p->privacy        = false;
+	p->allow_announce = true;
+	p->allow_force    = false;
+	p->allow_surveil  = false;
+	p->allow_hidden   = false;
+
+	(void)conf_get_bool(conf_cur(), "icprivacy", &p->privacy);
+	(void)conf_get_bool(conf_cur(), "icallow_announce",
+			    &p->allow_announce);
+	(void)conf_get_bool(conf_cur(), "icallow_force", &p->allow_force);
+	(void)conf_get_bool(conf_cur(), "icallow_surveil",
+			    &p->allow_surveil);
+	(void)conf_get_bool(conf_cur(), "icallow_hidden", &p->allow_hidden);
+
+	/* the account policies depend on the defaults, they are parsed
+	 * again on first use */
+	accextra_cache_flush(&icc.accx);
 }
 
 
-static bool is_surveillance(const struct pl *val)
+int events_init(void)
 {
-	return !pl_strcmp(val, "surveillance");
+	int err;
+
+	err = accextra_cache_init(&icc.accx, ic_policy_parse);
+	if (err)
+		return err;
+
+	events_conf_load();
+
+	return 0;
 }
 
 
-static bool is_hidden(const struct pl *val)
+void events_close(void)
 {
-	return !pl_strcmp(val, "hidden");
+	accextra_cache_close(&icc.accx);
 }
 
 
-static bool is_preview(const struct pl *val)
+static enum ic_type builtin_type(const struct pl *val)
 {
-	struct pl subj = PL("preview");
+	const char *subj;
+	enum ic_type type;
 
-	(void)conf_get(conf_cur(), "icpreview_subject", &subj);
-	return !strncmp(val->p, subj.p, subj.l);
-}
+	if (!val->l)
+		return IC_NONE;
 
+	/* the built-in subjects differ in the first character */
+	switch (val->p[0]) {
 
-static bool is_intercom(const struct pl *name, const struct pl *val)
-{
-	if (pl_strcmp(name, "Subject"))
-		return false;
-
-	if (is_normal(val) ||
-	    is_announcement(val) ||
-	    is_forcetalk(val) ||
-	    is_surveillance(val) ||
-	    is_preview(val) ||
-	    is_hidden(val) ||
-	    ic_is_custom(val))
-		return true;
-
-	return false;
+	case 'n': subj = "normal";       type = IC_NORMAL;   break;
+	case 'a': subj = "announcement"; type = IC_ANNOUNCE; break;
+	case 'f': subj = "forcetalk";    type = IC_FORCE;    break;
+	case 's': subj = "surveillance"; type = IC_SURVEIL;  break;
+	case 'h': subj = "hidden";       type = IC_HIDDEN;   break;
+	default:
+		return IC_NONE;
+	}
+
+	return pl_strcmp(val, subj) ? IC_NONE : type;
 }
 
 
-static bool account_extra_bool(const struct account *acc, const char *name,
-		bool *set)
+/**
+ * Classify a custom header
+ *
+ * @param name Header name
+ * @param val  Header value
+ *
+ * @return Intercom call type, IC_NONE if the header is no intercom Subject
+ */
+static enum ic_type ic_classify(const struct pl *name, const struct pl *val)
 {
-	struct pl pl = PL_INIT;
-	struct pl val = PL_INIT;
+	enum ic_type type;
 
-	pl_set_str(&pl, account_extra(acc));
+	if (!name || !val || pl_strcmp(name, "Subject"))
+		return IC_NONE;
 
-	if (!pl_isset(&pl))
-		return false;
+	/* custom prefixes take precedence over all types except normal and
+	 * hidden */
+	type = builtin_type(val);
+	if (type == IC_NORMAL || type == IC_HIDDEN)
+		return type;
 
-	if (!fmt_param_sep_get(&pl, name, ',', &val))
-		return false;
+	if (ic_is_custom(val))
+		return IC_CUSTOM;
 
-	if (!pl_strcmp(&val, "yes")) {
-		*set = true;
-		return true;
-	}
-	else if (!pl_strcmp(&val, "no")) {
-		*set = false;
-		return true;
-	}
+	if (type != IC_NONE)
+		return type;
+
+	if (val->l >= icc.previewlen &&
+	    !strncmp(val->p, icc.preview, icc.previewlen))
+		return IC_PREVIEW;
 
-	return false;
+	return IC_NONE;
 }
 
 
@@ -113,17 +209,11 @@ static int incoming_handler(const struct pl *name,
 	struct ua *ua  = call_get_ua(call);
 	struct account *acc  = ua_account(ua);
 	enum sdp_dir ardir, vrdir;
-	bool privacy        = false;
-	bool allow_announce = true;
-	bool allow_force    = false;
-	bool allow_surveil  = false;
-	bool allow_hidden   = false;
+	enum ic_type type = ic_classify(name, val);
+	const struct ic_policy *pol;
 	int err = 0;
 
-	if (!name || !val)
-		return 0;
-
-	if (!is_intercom(name, val))
+	if (type == IC_NONE)
 		return 0;
 
 	ardir =sdp_media_rdir(
@@ -136,19 +226,9 @@ static int incoming_handler(const struct pl *name,
 	     account_aor(acc), call_id(call), name, val,
 	     sdp_dir_name(ardir), sdp_dir_name(vrdir));
 
-	(void)conf_get_bool(conf_cur(), "icprivacy", &privacy);
-	(void)conf_get_bool(conf_cur(), "icallow_announce", &allow_announce);
-	(void)conf_get_bool(conf_cur(), "icallow_force", &allow_force);
-	(void)conf_get_bool(conf_cur(), "icallow_surveil", &allow_surveil);
-	(void)conf_get_bool(conf_cur(), "icallow_hidden", &allow_hidden);
-
-	(void)account_extra_bool(acc, "icprivacy", &privacy);
-	(void)account_extra_bool(acc, "icallow_announce", &allow_announce);
-	(void)account_extra_bool(acc, "icallow_force", &allow_force);
-	(void)account_extra_bool(acc, "icallow_surveil", &allow_surveil);
-	(void)account_extra_bool(acc, "icallow_hidden", &allow_hidden);
+	pol = ic_policy(acc);
 
-	if (privacy && is_normal(val)) {
+	if (pol->privacy && type == IC_NORMAL) {
 		info("intercom: auto answer suppressed - privacy mode on\n");
 		call_set_answer_delay(call, -1);
 		module_event("intercom", "override-aufile", ua, call,
@@ -156,9 +236,9 @@ static int incoming_handler(const struct pl *name,
 		return 0;
 	}
 
-	if (is_hidden(val)) {
+	if (type == IC_HIDDEN) {
 		int32_t adelay = call_answer_delay(call);
-		if (!allow_hidden) {
+		if (!pol->allow_hidden) {
 			reject_call(call, 406, "Not Acceptable");
 			return 0;
 		}
@@ -171,13 +251,13 @@ static int incoming_handler(const struct pl *name,
 
 	module_event("intercom", "incoming", ua, call, "%r", val);
 
-	if (is_normal(val)) {
+	if (type == IC_NORMAL) {
 		module_event("intercom", "override-aufile", ua, call,
 				"sip_autoanswer_aufile:icnormal_aufile");
 		return 0;
 	}
 
-	if (ic_is_custom(val)) {
+	if (type == IC_CUSTOM) {
 		struct pl *auf = iccustom_aufile(val);
 		if (!iccustom_allowed(val)) {
 			reject_call(call, 406, "Not Acceptable");
@@ -189,8 +269,8 @@ static int incoming_handler(const struct pl *name,
 		return 0;
 	}
 
-	if (is_announcement(val)) {
-		if (!allow_announce) {
+	if (type == IC_ANNOUNCE) {
+		if (!pol->allow_announce) {
 			reject_call(call, 406, "Not Acceptable");
 			return 0;
 		}
@@ -200,8 +280,8 @@ static int incoming_handler(const struct pl *name,
 		return 0;
 	}
 
-	if (is_forcetalk(val)) {
-		if (!allow_force) {
+	if (type == IC_FORCE) {
+		if (!pol->allow_force) {
 			reject_call(call, 406, "Not Acceptable");
 			return 0;
 		}
@@ -211,8 +291,8 @@ static int incoming_handler(const struct pl *name,
 		return 0;
 	}
 
-	if (is_surveillance(val)) {
-		if (!allow_surveil) {
+	if (type == IC_SURVEIL) {
+		if (!pol->allow_surveil) {
 			reject_call(call, 406, "Not Acceptable");
 			return 0;
 		}
@@ -222,7 +302,7 @@ static int incoming_handler(const struct pl *name,
 		return 0;
 	}
 
-	if (is_preview(val)) {
+	if (type == IC_PREVIEW) {
 		module_event("intercom", "override-aufile", ua, call,
 				"ring_aufile:icpreview_aufile");
 		err |= call_progress_dir(call, SDP_INACTIVE, SDP_RECVONLY);
@@ -238,10 +318,7 @@ static int outgoing_handler(const struct pl *name,
 	struct call *call = arg;
 	struct ua *ua  = call_get_ua(call);
 
-	if (!name || !val)
-		return 0;
-
-	if (!is_intercom(name, val))
+	if (ic_classify(name, val) == IC_NONE)
 		return 0;
 
 	module_event("intercom", "outgoing", ua, call, "%r", val);
@@ -257,13 +334,7 @@ static int check_hidden(const struct pl *name,
 {
 	struct bevent *event = arg;
 
-	if (!name || !val)
-		return 0;
-
-	if (!is_intercom(name, val))
-		return 0;
-
-	if (is_hidden(val))
+	if (ic_classify(name, val) == IC_HIDDEN)
 		bevent_stop(event);
 
 	return 0;
@@ -277,14 +348,12 @@ static int established_handler(const struct pl *name,
 	struct ua *ua  = call_get_ua(call);
 	enum sdp_dir aldir, vldir;
 	bool outgoing = call_is_outgoing(call);
+	enum ic_type type = ic_classify(name, val);
 
-	if (!name || !val)
-		return 0;
-
-	if (!is_intercom(name, val))
+	if (type == IC_NONE)
 		return 0;
 
-	if (outgoing && is_hidden(val)) {
+	if (outgoing && type == IC_HIDDEN) {
 		call_hidden_start(call);
 
 		audio_mute(call_audio(call), true);
@@ -296,7 +365,8 @@ static int established_handler(const struct pl *name,
 	vldir = sdp_media_ldir(
 			stream_sdpmedia(video_strm(call_video(call))));
 
-	if (outgoing && is_forcetalk(val)) {
+	/* forcetalk does not depend on an overlapping custom prefix */
+	if (outgoing && builtin_type(val) == IC_FORCE) {
 
 		/* this allows incoming re-INVITE with SDP dir SDP_SENDRECV */
 		call_set_media_direction(call,
@@ -330,6 +400,15 @@ void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 
 	case BEVENT_CREATE:
 		ua_add_xhdr_filter(ua, "Subject");
+		(void)ic_policy(ua_account(ua));
+		break;
+
+	case BEVENT_UNREGISTERING:
+		accextra_cache_remove(&icc.accx, ua_account(ua));
+		break;
+
+	case BEVENT_SHUTDOWN:
+		accextra_cache_flush(&icc.accx);
 		break;
 
 	case BEVENT_CALL_INCOMING:
@@ -347,11 +426,13 @@ void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 	case BEVENT_CALL_ESTABLISHED:
 
 		(void)custom_hdrs_apply(hdrs, established_handler, call);
+		icbatch_call_event(ev, call);
 		break;
 
 
 	case BEVENT_CALL_CLOSED:
 		call_hidden_close(call);
+		icbatch_call_event(ev, call);
 
 		break;
 
@@ -0,0 +1,503 @@
+/**
+ * @file icbatch.c Intercom announcement to many targets
+ *
+ * Copyright (C) 2026 Commend.com - c.spielberger@commend.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+
+
+#define DEBUG_MODULE "intercom"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+#include "intercom.h"
+#include "icbatch.h"
+
+
+/**
+ * An announcement to a group or a list of targets is dialed as a batch. The
+ * UAs of the targets are prepared once with the Subject header and auto
+ * answer, and at most `icannounce_concurrency` calls are dialing at the same
+ * time. A call counts as done when it is established or closed. The result
+ * of each target is reported as module event "announce-result" and can be
+ * listed with /icannounce_stat. Single intercom calls from a UA that is
+ * prepared by a running batch are rejected, since they would replace its
+ * header. /icannounce_stop cancels the pending targets and hangs up the
+ * calls that are still dialing.
+ *
+ * Configuration:
+ * icgroup                  <name> <address/number>  (one target per line)
+ * icannounce_concurrency   10
+ */
+
+
+enum {
+	CONCURRENCY = 10,         /**< Default number of dialing calls     */
+};
+
+
+enum ictarget_state {
+	ICT_PENDING = 0,
+	ICT_DIALING,
+	ICT_OK,
+	ICT_FAILED,
+};
+
+
+/** Target of a batch announcement  */
+struct ictarget {
+	struct le le;
+
+	char *uri;                /**< Target address/number               */
+	struct ua *ua;
+	struct call *call;
+	enum ictarget_state state;
+	uint16_t scode;           /**< Status code of a failed call        */
+	int err;                  /**< Error of a failed dial              */
+};
+
+
+/** Prepared UA of a batch  */
+struct icbatch_ua {
+	struct le le;
+
+	struct ua *ua;
+};
+
+
+static struct {
+	struct list targets;      /**< Targets (ictarget)                  */
+	struct list ual;          /**< Prepared UAs (icbatch_ua)           */
+	struct le *next;          /**< Next target to dial                 */
+	uint32_t active;          /**< Dialing calls                       */
+	uint32_t concurrency;     /**< Max. dialing calls                  */
+	enum sdp_dir adir;
+	enum sdp_dir vdir;
+	bool running;
+} b;
+
+
+static const char *state_name(enum ictarget_state st)
+{
+	switch (st) {
+
+	case ICT_PENDING: return "pending";
+	case ICT_DIALING: return "dialing";
+	case ICT_OK:      return "ok";
+	case ICT_FAILED:  return "failed";
+	default:          return "?";
+	}
+}
+
+
+static void ictarget_destructor(void *arg)
+{
+	struct ictarget *t = arg;
+
+	list_unlink(&t->le);
+	mem_deref(t->uri);
+}
+
+
+static void icbatch_ua_destructor(void *arg)
+{
+	struct icbatch_ua *bua = arg;
+
+	list_unlink(&bua->le);
+	icdial_release(bua->ua);
+}
+
+
+static bool icbatch_ua_cmp(struct le *le, void *arg)
+{
+	struct icbatch_ua *bua = le->data;
+
+	return bua->ua == arg;
+}
+
+
+static int icbatch_ua_prepare(struct ua *ua, const char *hdr)
+{
+	struct icbatch_ua *bua;
+	int err;
+
+	if (list_apply(&b.ual, true, icbatch_ua_cmp, ua))
+		return 0;
+
+	err = icdial_prepare(ua, hdr);
+	if (err) {
+		icdial_release(ua);
+		return err;
+	}
+
+	bua = mem_zalloc(sizeof(*bua), icbatch_ua_destructor);
+	if (!bua) {
+		icdial_release(ua);
+		return ENOMEM;
+	}
+
+	bua->ua = ua;
+	list_append(&b.ual, &bua->le, bua);
+
+	return 0;
+}
+
+
+/**
+ * Check if a UA is prepared by a running batch
+ *
+ * @param ua  User-Agent
+ *
+ * @return true if the UA is in use by the batch
+ */
+bool icbatch_ua_busy(const struct ua *ua)
+{
+	return list_apply(&b.ual, true, icbatch_ua_cmp, (void *)ua) != NULL;
+}
+
+
+static void ictarget_result(struct ictarget *t, enum ictarget_state state)
+{
+	t->state = state;
+
+	module_event("intercom", "announce-result", t->ua, t->call,
+		     "%s,%s,%u", t->uri, state_name(state), t->scode);
+}
+
+
+static void icbatch_finish(void)
+{
+	struct le *le;
+	uint32_t ok = 0, failed = 0;
+
+	for (le = list_head(&b.targets); le; le = le->next) {
+		const struct ictarget *t = le->data;
+
+		if (t->state == ICT_OK)
+			++ok;
+		else if (t->state == ICT_FAILED)
+			++failed;
+	}
+
+	b.running = false;
+	info("intercom: announcement done, %u ok, %u failed\n", ok, failed);
+	module_event("intercom", "announce-done", NULL, NULL, "%u,%u",
+		     ok, failed);
+}
+
+
+/**
+ * Dial the pending targets up to the concurrency limit
+ */
+static void icbatch_dial(void)
+{
+	while (b.next && b.active < b.concurrency) {
+		struct ictarget *t = b.next->data;
+
+		b.next = b.next->next;
+		if (t->state != ICT_PENDING)
+			continue;
+
+		t->err = icdial_connect(t->ua, &t->call, t->uri,
+					b.adir, b.vdir);
+		if (t->err) {
+			warning("intercom: could not connect %s (%m)\n",
+				t->uri, t->err);
+			ictarget_result(t, ICT_FAILED);
+			continue;
+		}
+
+		t->state = ICT_DIALING;
+		++b.active;
+	}
+
+	/* the headers are copied to the calls, the UAs are done */
+	if (!b.next)
+		list_flush(&b.ual);
+
+	if (!b.next && !b.active && b.running)
+		icbatch_finish();
+}
+
+
+static int ictarget_add(const struct pl *addr, const char *hdr)
+{
+	struct ictarget *t;
+	int err;
+
+	t = mem_zalloc(sizeof(*t), ictarget_destructor);
+	if (!t)
+		return ENOMEM;
+
+	err = pl_strdup(&t->uri, addr);
+	if (err) {
+		mem_deref(t);
+		return err;
+	}
+
+	list_append(&b.targets, &t->le, t);
+
+	t->ua = uag_find_requri(t->uri);
+	if (!t->ua) {
+		t->err = ENOENT;
+		ictarget_result(t, ICT_FAILED);
+		return 0;
+	}
+
+	t->err = icbatch_ua_prepare(t->ua, hdr);
+	if (t->err)
+		ictarget_result(t, ICT_FAILED);
+
+	return 0;
+}
+
+
+struct group_arg {
+	struct pl name;
+	const char *hdr;
+	uint32_t n;
+};
+
+
+static int group_handler(const struct pl *val, void *arg)
+{
+	struct group_arg *ga = arg;
+	struct pl name, addr;
+
+	if (re_regex(val->p, val->l, "[^ \t]+[ \t]+[^ \t]+", &name, NULL,
+		     &addr))
+		return 0;
+
+	if (pl_cmp(&name, &ga->name))
+		return 0;
+
+	++ga->n;
+	return ictarget_add(&addr, ga->hdr);
+}
+
+
+static int icbatch_targets(const struct pl *to, const char *hdr)
+{
+	struct group_arg ga;
+	struct pl pl = *to;
+	struct pl addr;
+	int err;
+
+	if (pl.l && pl.p[0] == '@') {
+		ga.name.p = pl.p + 1;
+		ga.name.l = pl.l - 1;
+		ga.hdr    = hdr;
+		ga.n      = 0;
+
+		err = conf_apply(conf_cur(), "icgroup", group_handler, &ga);
+		if (err)
+			return err;
+
+		return ga.n ? 0 : ENOENT;
+	}
+
+	while (!re_regex(pl.p, pl.l, "[^,]+", &addr)) {
+		err = ictarget_add(&addr, hdr);
+		if (err)
+			return err;
+
+		pl_advance(&pl, addr.p + addr.l - pl.p);
+		if (pl.l)
+			pl_advance(&pl, 1);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Start an announcement to a group or a list of targets
+ *
+ * @param pf    Print handler
+ * @param to    "@<group>" or comma-separated list of addresses/numbers
+ * @param adir  Audio direction
+ * @param vdir  Video direction
+ * @param hdr   Subject header value
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int icbatch_start(struct re_printf *pf, const struct pl *to,
+		  enum sdp_dir adir, enum sdp_dir vdir, const char *hdr)
+{
+	int err;
+
+	if (b.running) {
+		(void)re_hprintf(pf, "intercom: announcement in progress\n");
+		return EBUSY;
+	}
+
+	list_flush(&b.targets);
+	b.active = 0;
+	b.adir   = adir;
+	b.vdir   = vdir;
+
+	err = icbatch_targets(to, hdr);
+	if (err) {
+		(void)re_hprintf(pf, "intercom: invalid targets %r (%m)\n",
+				 to, err);
+		list_flush(&b.ual);
+		list_flush(&b.targets);
+		return err;
+	}
+
+	(void)re_hprintf(pf, "intercom: announcement to %u targets\n",
+			 list_count(&b.targets));
+
+	b.running = true;
+	b.next    = list_head(&b.targets);
+	icbatch_dial();
+
+	return 0;
+}
+
+
+/**
+ * Update the targets on call events
+ *
+ * @param ev    Event type
+ * @param call  Call object
+ */
+void icbatch_call_event(enum bevent_ev ev, struct call *call)
+{
+	struct ictarget *t = NULL;
+	struct le *le;
+
+	if (!call)
+		return;
+
+	for (le = list_head(&b.targets); le; le = le->next) {
+		t = le->data;
+
+		if (t->call == call)
+			break;
+	}
+
+	if (!le)
+		return;
+
+	switch (ev) {
+
+	case BEVENT_CALL_ESTABLISHED:
+		if (t->state != ICT_DIALING)
+			return;
+
+		--b.active;
+		ictarget_result(t, ICT_OK);
+		break;
+
+	case BEVENT_CALL_CLOSED:
+		if (t->state == ICT_DIALING) {
+			--b.active;
+			t->scode = call_scode(call);
+			ictarget_result(t, ICT_FAILED);
+		}
+
+		t->call = NULL;
+		break;
+
+	default:
+		return;
+	}
+
+	icbatch_dial();
+}
+
+
+static int cmd_stat(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	int err = 0;
+	(void)arg;
+
+	err |= re_hprintf(pf, "intercom: announcement %s, %u dialing\n",
+			  b.running ? "running" : "done", b.active);
+
+	for (le = list_head(&b.targets); le; le = le->next) {
+		const struct ictarget *t = le->data;
+
+		err |= re_hprintf(pf, "  %-40s %-8s", t->uri,
+				  state_name(t->state));
+		if (t->scode)
+			err |= re_hprintf(pf, " %u", t->scode);
+		else if (t->err)
+			err |= re_hprintf(pf, " %m", t->err);
+
+		err |= re_hprintf(pf, "\n");
+	}
+
+	return err;
+}
+
+
+static int cmd_stop(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	(void)arg;
+
+	if (!b.running)
+		return 0;
+
+	b.next = NULL;
+
+	for (le = list_head(&b.targets); le; le = le->next) {
+		struct ictarget *t = le->data;
+		struct call *call = NULL;
+
+		if (t->state == ICT_DIALING) {
+			--b.active;
+			call = t->call;
+		}
+		else if (t->state != ICT_PENDING) {
+			continue;
+		}
+
+		t->err = ECANCELED;
+		ictarget_result(t, ICT_FAILED);
+
+		/* the closed event does not find the target */
+		t->call = NULL;
+		if (call)
+			ua_hangup(t->ua, call, 0, NULL);
+	}
+
+	icbatch_dial();
+
+	return re_hprintf(pf, "intercom: announcement stopped\n");
+}
+
+
+static const struct cmd cmdv[] = {
+
+{"icannounce_stat", 0, 0, "Intercom announcement results",     cmd_stat},
+{"icannounce_stop", 0, 0, "Intercom stop announcement, hang up", cmd_stop},
+
+};
+
+
+int icbatch_init(void)
+{
+	b.concurrency = CONCURRENCY;
+	(void)conf_get_u32(conf_cur(), "icannounce_concurrency",
+			   &b.concurrency);
+	if (!b.concurrency)
+		b.concurrency = 1;
+
+	return cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
+}
+
+
+void icbatch_close(void)
+{
+	cmd_unregister(baresip_commands(), cmdv);
+	list_flush(&b.ual);
+	list_flush(&b.targets);
+	memset(&b, 0, sizeof(b));
+}
@@ -0,0 +1,13 @@
+/**
+ * @file icbatch.h Intercom announcement to many targets interface
+ *
+ * Copyright (C) 2026 Commend.com - c.spielberger@commend.com
+ */
+
+int  icbatch_start(struct re_printf *pf, const struct pl *to,
+		   enum sdp_dir adir, enum sdp_dir vdir, const char *hdr);
+void icbatch_call_event(enum bevent_ev ev, struct call *call);
+bool icbatch_ua_busy(const struct ua *ua);
+
+int  icbatch_init(void);
+void icbatch_close(void);
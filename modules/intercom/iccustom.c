@@ -16,6 +16,24 @@
 #include "intercom.h"
 #include "iccustom.h"
 
+
+enum {
+	MAX_LENS = 16,            /**< Max. distinct subject prefix lengths */
+};
+
+
+/**
+ * The custom intercom calls are hashed by subject prefix. A subject is
+ * looked up with one hash lookup per distinct prefix length, longest
+ * first, instead of comparing it with every prefix.
+ */
+static struct {
+	size_t lenv[MAX_LENS];    /**< Prefix lengths, descending          */
+	size_t lenc;
+	bool scan;                /**< Too many lengths, scan all          */
+} lens;
+
+
 struct iccustom {
 	struct le le;
 
@@ -79,6 +97,108 @@ static const struct cmd cmdv[] = {
 };
 
 
+static void iccustom_len_add(size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < lens.lenc; i++) {
+		if (lens.lenv[i] == len)
+			return;
+
+		if (lens.lenv[i] < len)
+			break;
+	}
+
+	if (lens.lenc == MAX_LENS) {
+		lens.scan = true;
+		return;
+	}
+
+	memmove(&lens.lenv[i + 1], &lens.lenv[i],
+		(lens.lenc - i) * sizeof(lens.lenv[0]));
+	lens.lenv[i] = len;
+	++lens.lenc;
+}
+
+
+static bool iccustom_cmp(struct le *le, void *arg)
+{
+	const struct pl *pl = arg;
+	const struct iccustom *c = le->data;
+
+	return !pl_cmp(&c->subject, pl);
+}
+
+
+struct iccustom_scan {
+	const struct pl *val;
+	struct iccustom *c;       /**< Longest match so far               */
+};
+
+
+static bool iccustom_longest(struct le *le, void *arg)
+{
+	struct iccustom_scan *sc = arg;
+	struct iccustom *c = le->data;
+
+	if (sc->c && sc->c->subject.l >= c->subject.l)
+		return false;
+
+	if (iccustom_lookup(le, (void *)sc->val))
+		sc->c = c;
+
+	return false;
+}
+
+
+/**
+ * Find the custom intercom call of a Subject
+ *
+ * @param hash Custom intercom calls
+ * @param val  Subject header value
+ *
+ * @return Custom intercom call with the longest matching prefix, or NULL
+ */
+struct iccustom *iccustom_match(const struct hash *hash,
+				const struct pl *val)
+{
+	struct iccustom_scan sc = {val, NULL};
+	struct pl key;
+	size_t i;
+
+	if (!val)
+		return NULL;
+
+	if (lens.scan) {
+		(void)hash_apply(hash, iccustom_longest, &sc);
+		return sc.c;
+	}
+
+	for (i = 0; i < lens.lenc; i++) {
+		struct le *le;
+
+		if (lens.lenv[i] > val->l)
+			continue;
+
+		key.p = val->p;
+		key.l = lens.lenv[i];
+		le = hash_lookup(hash, hash_joaat_pl(&key), iccustom_cmp,
+				 &key);
+		if (le)
+			return le->data;
+	}
+
+	return NULL;
+}
+
+
+void iccustom_flush(struct hash *hash)
+{
+	hash_flush(hash);
+	memset(&lens, 0, sizeof(lens));
+}
+
+
 int iccustom_handler(const struct pl *pl, void *arg)
 {
 	struct pl subject, dir, allowed, aufile;
@@ -102,6 +222,7 @@ int iccustom_handler(const struct pl *pl, void *arg)
 
 	info("intercom: add custom %r\n", &subject);
 	hash_append(hash, hash_joaat_pl(&subject), &c->le, c);
+	iccustom_len_add(subject.l);
 	return 0;
 }
 
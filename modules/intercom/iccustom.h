@@ -12,3 +12,6 @@ bool iccustom_lookup(struct le *le, void *arg);
 bool iccustom_allowed(const struct pl *val);
 struct pl *iccustom_aufile(const struct pl *val);
 int iccustom_handler(const struct pl *pl, void *arg);
+struct iccustom *iccustom_match(const struct hash *hash,
+				const struct pl *val);
+void iccustom_flush(struct hash *hash);
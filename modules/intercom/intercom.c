@@ -49,10 +49,23 @@
  * iccustom                     Intercom/UID,sendrecv,true,ic_aufile
  * ic_aufile                    beep.wav
  *
+ * Announcement to a group or a list of targets:
+ * /icannounce @<group> audio=<on,off> video=<on,off>
+ * /icannounce <addr>,<addr>,... audio=<on,off> video=<on,off>
+ *
+ * icgroup                      <name> <address/number>
+ * icannounce_concurrency       10
+ *
+ * The calls of a group or list are dialed with at most
+ * icannounce_concurrency calls at a time. The result of each target is
+ * reported by module event "announce-result" and printed by
+ * /icannounce_stat. /icannounce_stop cancels the targets not yet dialed.
+ *
  * Extra accounts address parameters:
  * The settings for icprivacy, icallow_announce, icallow_force, icallow_surveil
- * can be overwritten by specifying address parameter `extra` in accounts file.
- * The value for extra is a comma-separated list of settings. E.g.:
+ * and icallow_hidden can be overwritten by specifying address parameter
+ * `extra` in accounts file. The value for extra is a comma-separated list of
+ * settings. They are read when the UA is created and on /icreload. E.g.:
  *
  * <sip:A@localhost>;sip_autoanswer=yes;extra=icprivacy=yes,icallow_announce=no
  *
@@ -65,6 +78,7 @@
 
 #include "iccustom.h"
 #include "ichidden.h"
+#include "icbatch.h"
 #include "intercom.h"
 
 struct intercom {
@@ -149,6 +163,84 @@ static int cmd_set_ansval(struct re_printf *pf, void *arg)
 }
 
 
+/**
+ * Prepare a UA for intercom calls
+ *
+ * Adds the Subject header and enables auto answer, which are copied to the
+ * calls that the UA connects until icdial_release() is called.
+ *
+ * @param ua   User-Agent
+ * @param hdr  Subject header value
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int icdial_prepare(struct ua *ua, const char *hdr)
+{
+	struct pl n = PL("Subject");
+	struct pl v = PL_INIT;
+	int err;
+
+	pl_set_str(&v, hdr);
+	err = ua_add_custom_hdr(ua, &n, &v);
+	if (err) {
+		warning("intercom: could not add header %s\n", hdr);
+		return EINVAL;
+	}
+
+	ua_set_autoanswer_value(ua, st.ansval);
+	return ua_enable_autoanswer(ua, st.adelay, st.met);
+}
+
+
+void icdial_release(struct ua *ua)
+{
+	struct pl n = PL("Subject");
+
+	(void)ua_disable_autoanswer(ua, st.met);
+	(void)ua_rm_custom_hdr(ua, &n);
+}
+
+
+/**
+ * Connect an intercom call from a prepared UA
+ *
+ * @param ua     User-Agent
+ * @param callp  Returns the call
+ * @param to     Target address/number
+ * @param adir   Audio direction
+ * @param vdir   Video direction
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int icdial_connect(struct ua *ua, struct call **callp, const char *to,
+		   enum sdp_dir adir, enum sdp_dir vdir)
+{
+	struct mbuf *uribuf;
+	char *uri = NULL;
+	int err;
+
+	uribuf = mbuf_alloc(64);
+	if (!uribuf)
+		return ENOMEM;
+
+	err = account_uri_complete(ua_account(ua), uribuf, to);
+	if (err)
+		goto out;
+
+	uribuf->pos = 0;
+	err = mbuf_strdup(uribuf, &uri, uribuf->end);
+	if (err)
+		goto out;
+
+	err = ua_connect_dir(ua, callp, NULL, uri, VIDMODE_ON, adir, vdir);
+
+out:
+	mem_deref(uribuf);
+	mem_deref(uri);
+	return err;
+}
+
+
 int common_icdial(struct re_printf *pf, const char *cmd,
 		  enum sdp_dir dir, const char *prm, const char *hdr,
 		  struct call **callp)
@@ -159,11 +251,8 @@ int common_icdial(struct re_printf *pf, const char *cmd,
 	struct pl von = PL("on");
 	enum sdp_dir adir, vdir;
 	char *uri     = NULL;
-	struct mbuf *uribuf = NULL;
 	struct ua *ua;
 	struct call *call;
-	struct pl n   = PL("Subject");
-	struct pl v   = PL_INIT;
 	const char *usage = "usage: /%s <address/number>"
 			" audio=<on,off>"
 			" video=<on,off>\n";
@@ -181,6 +270,14 @@ int common_icdial(struct re_printf *pf, const char *cmd,
 		return EINVAL;
 	}
 
+	adir = !pl_strcmp(&aon, "on") ? dir : SDP_INACTIVE;
+	vdir = !pl_strcmp(&von, "on") ? dir : SDP_INACTIVE;
+
+	/* a group or a list of targets */
+	if (!str_cmp(cmd, "icannounce") &&
+	    (pl_strchr(&to, '@') == to.p || pl_strchr(&to, ',')))
+		return icbatch_start(pf, &to, adir, vdir, hdr);
+
 	pl_strdup(&uri, &to);
 	ua = uag_find_requri(uri);
 	if (!ua) {
@@ -189,55 +286,34 @@ int common_icdial(struct re_printf *pf, const char *cmd,
 		goto out;
 	}
 
-	pl_set_str(&v, hdr);
-	err = ua_add_custom_hdr(ua, &n, &v);
-	if (err) {
-		warning("intercom: %s could not add header %s\n", cmd, hdr);
-		err = EINVAL;
-		goto out;
-	}
-
-	adir = !pl_strcmp(&aon, "on") ? dir : SDP_INACTIVE;
-	vdir = !pl_strcmp(&von, "on") ? dir : SDP_INACTIVE;
-
-	uribuf = mbuf_alloc(64);
-	if (!uribuf) {
-		err = ENOMEM;
-		goto out;
-	}
-
-	err = account_uri_complete(ua_account(ua), uribuf, uri);
-	if (err) {
-		(void)re_hprintf(pf, "ua_connect failed to complete uri\n");
+	/* the header of the UA belongs to the announcement */
+	if (icbatch_ua_busy(ua)) {
+		(void)re_hprintf(pf, "intercom: announcement in progress\n");
+		err = EBUSY;
 		goto out;
 	}
 
-	mem_deref(uri);
-
-	uribuf->pos = 0;
-	err = mbuf_strdup(uribuf, &uri, uribuf->end);
+	err = icdial_prepare(ua, hdr);
 	if (err)
-		goto out;
+		goto release;
 
 	re_hprintf(pf, "call uri: %s\n", uri);
 
-	ua_set_autoanswer_value(ua, st.ansval);
-	err |= ua_enable_autoanswer(ua, st.adelay, st.met);
-	if (err)
-		goto out;
-
-	err = ua_connect_dir(ua, &call, NULL, uri, VIDMODE_ON, adir, vdir);
-	if (err)
-		goto out;
+	err = icdial_connect(ua, &call, uri, adir, vdir);
+	if (err) {
+		(void)re_hprintf(pf, "intercom: could not connect %s (%m)\n",
+				 uri, err);
+		goto release;
+	}
 
 	re_hprintf(pf, "call id: %s\n", call_id(call));
 	if (callp)
 		*callp = call;
+
+release:
+	icdial_release(ua);
 out:
-	mem_deref(uribuf);
 	mem_deref(uri);
-	(void)ua_disable_autoanswer(ua, st.met);
-	(void)ua_rm_custom_hdr(ua, &n);
 	return 0;
 }
 
@@ -289,9 +365,10 @@ static int cmd_reload(struct re_printf *pf, void *arg)
 		return err;
 	}
 
-	hash_flush(st.custom);
+	iccustom_flush(st.custom);
 	err = conf_apply(conf_cur(), "iccustom", iccustom_handler,
 			 st.custom);
+	events_conf_load();
 	return err;
 }
 
@@ -329,15 +406,7 @@ static const struct cmd cmdv[] = {
 
 struct iccustom *iccustom_find(const struct pl *val)
 {
-	struct pl key;
-	struct le *le;
-
-	key = *val;
-	le = hash_apply(st.custom, iccustom_lookup, &key);
-	if (le)
-		return le->data;
-
-	return NULL;
+	return iccustom_match(st.custom, val);
 }
 
 
@@ -360,10 +429,12 @@ static int module_init(void)
 		st.met = ANSM_ALERTINFO;
 
 	(void)conf_apply(conf_cur(), "iccustom", iccustom_handler, st.custom);
+	err |= events_init();
 	err |= bevent_register(event_handler, NULL);
 	err |= uag_add_xhdr_intercom();
 	err |= iccustom_init();
 	err |= ichidden_init();
+	err |= icbatch_init();
 
 	info("intercom: init\n");
 	return err;
@@ -373,13 +444,15 @@ static int module_init(void)
 static int module_close(void)
 {
 
-	hash_flush(st.custom);
+	iccustom_flush(st.custom);
 	mem_deref(st.custom);
 	mem_deref(st.ansval);
 	cmd_unregister(baresip_commands(), cmdv);
 	bevent_unregister(event_handler);
 	iccustom_close();
 	ichidden_close();
+	icbatch_close();
+	events_close();
 
 	return 0;
 }
@@ -6,9 +6,16 @@
 
 
 void event_handler(enum bevent_ev ev, struct bevent *event, void *arg);
+int  events_init(void);
+void events_close(void);
+void events_conf_load(void);
 
 int mem_deref_later(void *arg);
 struct iccustom *iccustom_find(const struct pl *val);
+int icdial_prepare(struct ua *ua, const char *hdr);
+void icdial_release(struct ua *ua);
+int icdial_connect(struct ua *ua, struct call **callp, const char *to,
+		   enum sdp_dir adir, enum sdp_dir vdir);
 int common_icdial(struct re_printf *pf, const char *cmd,
 		  enum sdp_dir dir, const char *prm, const char *hdr,
 		  struct call **callp);
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <re.h>
 #include <baresip.h>
+#include <accextra.h>
+#include <tmrwheel.h>
 
 
 /**
@@ -19,14 +21,52 @@
  * like a change in a NAT binding.
  *
  * Configuration:
- * kaoptions     [seconds]
+ * kaoptions_timeout    [ms]      response timeout (default 4000)
+ * kaoptions_failures   [count]   consecutive failures until the UA is
+ *                                re-registered (default 3, 0 disables)
  *
  * Extra account address parameters:
  * The module can be activated by adding the kaoptions to the accounts
  * parameter `extra`.
  *
+ * kaoptions_max=<sec> enables the adaptive interval up to this value.
+ *
  * Example:
  * <sip:A@sip.example.com>;extra=kaoptions=30
+ * <sip:A@sip.example.com>;extra=kaoptions=20,kaoptions_max=300
+ *
+ * The keepalives of all UAs are driven by one timing wheel. The first
+ * OPTIONS of a UA is sent at a phase within its interval that is spread
+ * evenly over the UAs, and the following ones keep this phase. Thus the
+ * requests of many UAs with the same interval do not burst.
+ *
+ * The responses are tracked per UA. An OPTIONS that is not answered within
+ * the timeout, or answered with an error, counts as failure. After the
+ * configured number of consecutive failures a BEVENT_MODULE with
+ * "keepalive failed" is triggered and the UA is re-registered. The
+ * registration then tries the outbound proxies of the account again. The
+ * next answered OPTIONS triggers "keepalive restored". The command
+ * /kaoptions_stats prints the statistics of all UAs.
+ *
+ * In adaptive mode the interval starts at `kaoptions` and is lengthened by
+ * 50% after each answered OPTIONS, up to `kaoptions_max`. The public
+ * address of the UA is taken from the received and rport parameters of
+ * the Via header in the responses. If it changes, the NAT binding has
+ * expired within the last interval. The interval then settles at 90% of
+ * the longest interval that kept the binding, and the UA is re-registered
+ * to renew its contact. A failure also ends the probing. The settled
+ * interval is reported with a BEVENT_MODULE "keepalive interval".
+ * Adaptive mode requires a registrar that supports rport (RFC 3581).
+ *
+ * The probing only detects a NAT that maps a new binding to another public
+ * address or port. A port-preserving NAT maps the new binding to the same
+ * public port, so an expired binding is not visible in the Via header,
+ * while requests from the proxy are dropped until the next keepalive. If
+ * the public port equals the local port, the NAT is assumed to preserve
+ * ports (or there is no NAT) and the interval stays at `kaoptions`. A NAT
+ * that preserves ports only for some bindings can still defeat the
+ * detection, so `kaoptions_max` should not exceed the shortest binding
+ * timeout that is plausible for the network.
  *
  */
 
@@ -36,13 +76,45 @@
 #include <re_dbg.h>
 
 
+enum {
+	WHEEL_TICK = 100,        /**< Timing wheel resolution [ms]         */
+};
+
+
+/** Keepalive statistics of a UA  */
+struct kao_stats {
+	uint32_t sent;           /**< Sent requests                        */
+	uint32_t answered;       /**< Answered in time                     */
+	uint32_t lost;           /**< Failed or not answered in time       */
+	uint32_t failures;       /**< Consecutive failures                 */
+	uint32_t rtt;            /**< Last round-trip time [ms]            */
+	uint32_t srtt;           /**< Smoothed round-trip time [ms]        */
+	uint32_t rttvar;         /**< Round-trip time variation [ms]       */
+	bool failed;             /**< Failure was reported                 */
+};
+
+
 struct kaoptions {
 	struct list ka_ual;
+	struct accextra_cache accx;
+	struct tmrwheel wheel;
+	uint32_t phase;          /**< Phase of the next UA [1/2^32]        */
+	uint32_t timeout;        /**< Response timeout [ms]                */
+	uint32_t failures;       /**< Failures until re-register           */
+};
+
+
+/** Keepalive settings of an account  */
+struct kao_acc {
+	uint32_t interval;       /**< Keepalive interval [s]               */
+	uint32_t max;            /**< Adaptive interval limit [s]          */
 };
 
 
 static struct kaoptions kao = {
-	LIST_INIT,
+	.ka_ual   = LIST_INIT,
+	.timeout  = 4000,
+	.failures = 3,
 };
 
 
@@ -50,17 +122,330 @@ struct kao_element {
 	struct le le;
 
 	struct ua *ua;
-	struct tmr tmr;
+	struct tmrwheel_tmr tmr;
+	char *uri;               /**< Encoded Request-URI                  */
+
+	uint64_t ka_interval;    /**< Keepalive interval [ms]              */
+	uint64_t due;            /**< Next send time [ms]                  */
+	uint64_t ts_sent;        /**< Last send time [ms]                  */
+	uint64_t ka_min;         /**< Configured interval [ms]             */
+	uint64_t ka_max;         /**< Adaptive interval limit [ms]         */
+	uint64_t ka_good;        /**< Longest interval keeping the NAT
+				      binding [ms]                         */
+	bool settled;            /**< Adaptive interval is fixed           */
+	struct sa mapped;        /**< Public address from Via              */
+	struct kao_probe *probe; /**< OPTIONS in progress                  */
+	struct kao_stats st;
+};
 
-	size_t ka_interval;
+
+/** OPTIONS request of a keepalive  */
+struct kao_probe {
+	struct kao_element *kaoe;
+	struct tmrwheel_tmr to_tmr;
+	uint64_t ts_sent;        /**< Send time [ms]                       */
+	uint64_t idle;           /**< Time since the previous request [ms] */
 };
 
 
+static void kao_probe_destructor(void *arg)
+{
+	struct kao_probe *probe = arg;
+
+	tmrwheel_tmr_cancel(&probe->to_tmr);
+}
+
+
+static void kao_probe_detach(struct kao_probe *probe)
+{
+	tmrwheel_tmr_cancel(&probe->to_tmr);
+	probe->kaoe->probe = NULL;
+	probe->kaoe = NULL;
+}
+
+
 static void kao_element_destructor(void *arg)
 {
 	struct kao_element *kaoe = arg;
 
-	tmr_cancel(&kaoe->tmr);
+	/* the pending OPTIONS frees its probe on completion */
+	if (kaoe->probe)
+		kao_probe_detach(kaoe->probe);
+
+	tmrwheel_tmr_cancel(&kaoe->tmr);
+	mem_deref(kaoe->uri);
+}
+
+
+static uint32_t udiff(uint32_t a, uint32_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+
+/**
+ * Get the public address of the UA from the Via header of a response
+ *
+ * @param msg SIP response
+ * @param sa  Returns the address
+ *
+ * @return 0 if success, ENOENT if the registrar does not support rport
+ */
+static int kao_mapped(const struct sip_msg *msg, struct sa *sa)
+{
+	struct pl rport, rcvd;
+	int err;
+
+	if (msg_param_decode(&msg->via.params, "rport", &rport) ||
+	    !pl_isset(&rport))
+		return ENOENT;
+
+	if (msg_param_decode(&msg->via.params, "received", &rcvd)) {
+		*sa = msg->via.addr;
+	}
+	else {
+		err = sa_set(sa, &rcvd, 0);
+		if (err)
+			return err;
+	}
+
+	sa_set_port(sa, pl_u32(&rport));
+
+	return 0;
+}
+
+
+/**
+ * Fix the adaptive interval
+ *
+ * @param kaoe Keepalive element
+ * @param good Use 90% of the longest interval that kept the NAT binding
+ */
+static void kao_settle(struct kao_element *kaoe, bool good)
+{
+	kaoe->settled = true;
+
+	if (good)
+		kaoe->ka_interval = kaoe->ka_good ?
+			max(kaoe->ka_good * 9 / 10, (uint64_t)WHEEL_TICK) :
+			kaoe->ka_min;
+
+	info("kaoptions: %s: keepalive interval %llu ms\n",
+	     account_aor(ua_account(kaoe->ua)), kaoe->ka_interval);
+	module_event("kaoptions", "keepalive interval", kaoe->ua, NULL,
+		     "%llu", kaoe->ka_interval / 1000);
+}
+
+
+/**
+ * Lengthen the adaptive interval until the NAT binding expires
+ *
+ * @param kaoe Keepalive element
+ * @param msg  SIP response
+ * @param idle Idle time before the request [ms]
+ */
+static void kao_adapt(struct kao_element *kaoe, const struct sip_msg *msg,
+		      uint64_t idle)
+{
+	struct sa mapped;
+	int err;
+
+	if (!kaoe->ka_max)
+		return;
+
+	if (kao_mapped(msg, &mapped)) {
+		if (!kaoe->settled)
+			kao_settle(kaoe, false);
+		return;
+	}
+
+	if (!sa_isset(&kaoe->mapped, SA_ALL)) {
+		kaoe->mapped = mapped;
+
+		/* an expired binding would get the same public port */
+		if (!kaoe->settled &&
+		    sa_port(&mapped) == sa_port(&msg->dst)) {
+			info("kaoptions: %s: public port %u is preserved, "
+			     "adaptive interval disabled\n",
+			     account_aor(ua_account(kaoe->ua)),
+			     sa_port(&mapped));
+			kaoe->ka_interval = kaoe->ka_min;
+			kao_settle(kaoe, false);
+			return;
+		}
+	}
+	else if (!sa_cmp(&kaoe->mapped, &mapped, SA_ALL)) {
+		info("kaoptions: %s: NAT binding expired within %llu ms "
+		     "(%J -> %J)\n", account_aor(ua_account(kaoe->ua)),
+		     idle, &kaoe->mapped, &mapped);
+
+		kaoe->mapped = mapped;
+		kao_settle(kaoe, true);
+
+		err = ua_register(kaoe->ua);
+		if (err)
+			warning("kaoptions: re-register failed (%m)\n", err);
+		return;
+	}
+	else {
+		kaoe->ka_good = max(kaoe->ka_good, idle);
+	}
+
+	if (kaoe->settled)
+		return;
+
+	/* the binding survived the longest interval */
+	if (idle + WHEEL_TICK >= kaoe->ka_max) {
+		kao_settle(kaoe, false);
+		return;
+	}
+
+	kaoe->ka_interval = min(kaoe->ka_interval * 3 / 2, kaoe->ka_max);
+}
+
+
+static void kao_success(struct kao_element *kaoe, uint32_t rtt)
+{
+	struct kao_stats *st = &kaoe->st;
+
+	if (!st->answered) {
+		st->srtt   = rtt;
+		st->rttvar = rtt / 2;
+	}
+	else {
+		/* RFC 6298 with alpha 1/8 and beta 1/4 */
+		st->rttvar = (3 * st->rttvar + udiff(st->srtt, rtt)) / 4;
+		st->srtt   = (7 * st->srtt + rtt) / 8;
+	}
+
+	++st->answered;
+	st->rtt = rtt;
+	st->failures = 0;
+
+	if (!st->failed)
+		return;
+
+	st->failed = false;
+	module_event("kaoptions", "keepalive restored", kaoe->ua, NULL,
+		     "%u", rtt);
+}
+
+
+static void kao_failure(struct kao_element *kaoe)
+{
+	struct kao_stats *st = &kaoe->st;
+	int err;
+
+	++st->lost;
+	++st->failures;
+
+	if (kaoe->ka_max && !kaoe->settled)
+		kao_settle(kaoe, true);
+
+	if (!kao.failures || st->failures < kao.failures)
+		return;
+
+	/* re-register on every further failure series */
+	st->failures = 0;
+
+	if (!st->failed) {
+		st->failed = true;
+		module_event("kaoptions", "keepalive failed", kaoe->ua, NULL,
+			     "%u", kao.failures);
+	}
+
+	info("kaoptions: %s: %u keepalives failed, re-registering\n",
+	     account_aor(ua_account(kaoe->ua)), kao.failures);
+
+	err = ua_register(kaoe->ua);
+	if (err)
+		warning("kaoptions: re-register failed (%m)\n", err);
+}
+
+
+static void options_resp_handler(int err, const struct sip_msg *msg,
+				 void *arg)
+{
+	struct kao_probe *probe = arg;
+	struct kao_element *kaoe = probe->kaoe;
+
+	/* timed out or UA stopped */
+	if (!kaoe)
+		goto out;
+
+	kao_probe_detach(probe);
+
+	if (err || !msg || msg->scode >= 300) {
+		kao_failure(kaoe);
+		goto out;
+	}
+
+	kao_success(kaoe, (uint32_t)(tmr_jiffies() - probe->ts_sent));
+	kao_adapt(kaoe, msg, probe->idle);
+
+out:
+	mem_deref(probe);
+}
+
+
+static void to_handler(void *arg)
+{
+	struct kao_probe *probe = arg;
+	struct kao_element *kaoe = probe->kaoe;
+
+	/* a late response is ignored */
+	kao_probe_detach(probe);
+	kao_failure(kaoe);
+}
+
+
+static void kao_probe_send(struct kao_element *kaoe)
+{
+	struct kao_probe *probe;
+	int err;
+
+	probe = mem_zalloc(sizeof(*probe), kao_probe_destructor);
+	if (!probe)
+		return;
+
+	err = ua_options_send(kaoe->ua, kaoe->uri, options_resp_handler,
+			      probe);
+	if (err) {
+		DEBUG_WARNING("could not send OPTIONS to %s (%m)\n",
+			      kaoe->uri, err);
+		mem_deref(probe);
+		kao_failure(kaoe);
+		return;
+	}
+
+	++kaoe->st.sent;
+	probe->kaoe = kaoe;
+	probe->ts_sent = tmr_jiffies();
+	probe->idle = probe->ts_sent - kaoe->ts_sent;
+	kaoe->ts_sent = probe->ts_sent;
+	kaoe->probe = probe;
+
+	tmrwheel_tmr_start(&kao.wheel, &probe->to_tmr,
+			   min((uint64_t)kao.timeout, kaoe->ka_interval),
+			   to_handler, probe);
+}
+
+
+/**
+ * Get the send offset of the next UA within its interval
+ *
+ * The offsets follow the golden ratio sequence, so that the UAs are spread
+ * evenly over the interval for any number of UAs.
+ *
+ * @param interval Keepalive interval [ms]
+ *
+ * @return Offset [ms]
+ */
+static uint64_t kao_phase(uint64_t interval)
+{
+	kao.phase += 0x9e3779b9;
+
+	return interval * kao.phase >> 32;
 }
 
 
@@ -82,34 +467,31 @@ static bool kao_element_ua_cmp(struct le *le, void *arg)
 
 
 /**
- * Get specified field in the accounts extra parameter list
+ * Parse the keepalive settings of an account
  *
  * @param acc  Accounts object
- * @param n    Specified field
- * @param v    Int ptr for the specified value
  *
- * @return 0 if success, otherwise errorcode
+ * @return Settings object, NULL if keepalive is not enabled
  */
-static int account_extra_int(const struct account *acc, const char *n, int *v)
+static void *kao_acc_parse(const struct account *acc)
 {
-	struct pl pl;
-	struct pl val;
-	const char *extra = NULL;
+	struct kao_acc *ka;
+	uint32_t sec = 0;
 
-	if (!acc || !n  || !v)
-		return EINVAL;
+	if (account_extra_u32(acc, "kaoptions", &sec) || !sec)
+		return NULL;
 
-	extra = account_extra(acc);
-	if (!str_isset(extra))
-		return EINVAL;
+	ka = mem_zalloc(sizeof(*ka), NULL);
+	if (!ka)
+		return NULL;
 
-	pl_set_str(&pl, account_extra(acc));
-	if (!fmt_param_sep_get(&pl, n, ',', &val))
-		return EINVAL;
+	ka->interval = sec;
 
-	*v = pl_u32(&val);
+	if (!account_extra_u32(acc, "kaoptions_max", &sec) &&
+	    sec > ka->interval)
+		ka->max = sec;
 
-	return 0;
+	return ka;
 }
 
 
@@ -120,24 +502,22 @@ static int account_extra_int(const struct account *acc, const char *n, int *v)
  */
 static void keepalive_send_handler(void *arg)
 {
-	struct account *acc = NULL;
 	struct kao_element *kaoe = arg;
-	char *uri = NULL;
-	int err = 0;
+	uint64_t now = tmr_jiffies();
 
-	acc = ua_account(kaoe->ua);
-	err = re_sdprintf(&uri, "%H", uri_encode, account_luri(acc));
-	if (err)
-		goto out;
+	/* keep the phase, unless the loop was blocked for an interval */
+	kaoe->due += kaoe->ka_interval;
+	if (kaoe->due <= now)
+		kaoe->due = now + kaoe->ka_interval;
 
-	err = ua_options_send(kaoe->ua, uri, NULL, NULL);
-	if (err)
-		goto out;
+	tmrwheel_tmr_start_at(&kao.wheel, &kaoe->tmr, kaoe->due,
+			      keepalive_send_handler, kaoe);
 
-	tmr_start(&kaoe->tmr, kaoe->ka_interval, keepalive_send_handler, kaoe);
+	/* the timeout is at most one interval */
+	if (kaoe->probe)
+		to_handler(kaoe->probe);
 
-out:
-	mem_deref(uri);
+	kao_probe_send(kaoe);
 }
 
 
@@ -153,16 +533,16 @@ static int kaoptions_alloc(struct ua *ua)
 	struct account *acc;
 	struct le *le;
 	struct kao_element *kaoe = NULL;
-	int sec = 0;
-	int err = 0;
+	const struct kao_acc *ka;
+	int err;
 
 	if (!ua)
 		return EINVAL;
 
 	acc = ua_account(ua);
-	err = account_extra_int(acc, "kaoptions", &sec);
-	if (err)
-		return err;
+	ka = accextra_get(&kao.accx, acc);
+	if (!ka)
+		return EINVAL;
 
 	le = list_apply(&kao.ka_ual, true, kao_element_ua_cmp, ua);
 	if (le)
@@ -172,13 +552,24 @@ static int kaoptions_alloc(struct ua *ua)
 	if (!kaoe)
 		return ENOMEM;
 
+	err = re_sdprintf(&kaoe->uri, "%H", uri_encode, account_luri(acc));
+	if (err) {
+		mem_deref(kaoe);
+		return err;
+	}
+
 	kaoe->ua = ua;
-	kaoe->ka_interval = sec * 1000;
-	tmr_start(&kaoe->tmr, kaoe->ka_interval, keepalive_send_handler, kaoe);
+	kaoe->ka_interval = ka->interval * 1000ULL;
+	kaoe->ka_min = kaoe->ka_interval;
+	kaoe->ka_max = ka->max * 1000ULL;
+	kaoe->ts_sent = tmr_jiffies();
+	kaoe->due = kaoe->ts_sent + kao_phase(kaoe->ka_interval);
+	tmrwheel_tmr_start_at(&kao.wheel, &kaoe->tmr, kaoe->due,
+			      keepalive_send_handler, kaoe);
 
 	list_append(&kao.ka_ual, &kaoe->le, kaoe);
 
-	return err;
+	return 0;
 }
 
 
@@ -209,12 +600,52 @@ static int kaoptions_stop(struct ua *ua)
 }
 
 
+static int kao_element_print(struct re_printf *pf,
+			     const struct kao_element *kaoe)
+{
+	const struct kao_stats *st = &kaoe->st;
+
+	return re_hprintf(pf, "%-40s %5llu %5u %5u %5u %5u %5u %5u %5u%s\n",
+			  account_aor(ua_account(kaoe->ua)),
+			  kaoe->ka_interval / 1000, st->sent, st->answered,
+			  st->lost, st->failures, st->rtt, st->srtt,
+			  st->rttvar,
+			  st->failed ? " failed" : "");
+}
+
+
+static int cmd_kaoptions_stats(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	int err;
+	(void)arg;
+
+	err = re_hprintf(pf, "%-40s %5s %5s %5s %5s %5s %5s %5s %5s\n",
+			 "ua", "int", "sent", "ok", "lost", "fail", "rtt",
+			 "srtt", "jitt");
+
+	for (le = list_head(&kao.ka_ual); le && !err; le = le->next)
+		err = kao_element_print(pf, le->data);
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{"kaoptions_stats", 0, 0, "Keepalive statistics",
+	 cmd_kaoptions_stats},
+};
+
+
 static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 {
 	struct ua *ua = bevent_get_ua(event);
 	(void) arg;
 
 	switch (ev) {
+		case BEVENT_CREATE:
+				(void)accextra_get(&kao.accx, ua_account(ua));
+			break;
 		case BEVENT_REGISTER_OK:
 				kaoptions_alloc(ua);
 			break;
@@ -223,6 +654,11 @@ static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 			break;
 		case BEVENT_UNREGISTERING:
 				kaoptions_stop(ua);
+				accextra_cache_remove(&kao.accx,
+						      ua_account(ua));
+			break;
+		case BEVENT_SHUTDOWN:
+				accextra_cache_flush(&kao.accx);
 			break;
 
 		default:
@@ -235,7 +671,16 @@ static int module_init(void)
 {
 	int err;
 
-	err = bevent_register(event_handler, NULL);
+	(void)conf_get_u32(conf_cur(), "kaoptions_timeout", &kao.timeout);
+	(void)conf_get_u32(conf_cur(), "kaoptions_failures", &kao.failures);
+	tmrwheel_init(&kao.wheel, WHEEL_TICK);
+
+	err = accextra_cache_init(&kao.accx, kao_acc_parse);
+	if (err)
+		return err;
+
+	err  = bevent_register(event_handler, NULL);
+	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 
 	info("kaoptions: init\n");
 	return err;
@@ -244,8 +689,11 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	cmd_unregister(baresip_commands(), cmdv);
 	bevent_unregister(event_handler);
 	list_flush(&kao.ka_ual);
+	accextra_cache_close(&kao.accx);
+	tmrwheel_close(&kao.wheel);
 
 	return 0;
 }
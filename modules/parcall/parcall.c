@@ -28,13 +28,82 @@
  /paradd <name> <SIP address>    add a call target to a parallel group
  /parcall <name>                 initiate a parallel call of given group
  /pardebug                       print parallel call data
+ /parstats                       print parallel call statistics
+ /parreload                      reload parallel call groups from config
+ /parlimit <name> <max>          limit concurrent call legs of a group
  \endverbatim
+ *
+ * Parallel call groups can also be defined in the config. Each line adds a
+ * call target to a group, the group is created with its first target:
+ \verbatim
+ parcall_group    <name> <SIP address>
+ parcall_group    <name> <display name> <sip:uri>
+ \endverbatim
+ *
+ * The config groups are loaded at module init. /parreload re-reads the
+ * config and applies only the differences: targets and groups that are no
+ * longer configured are removed, unchanged ones keep their statistics. A
+ * group that still has targets added with /paradd is kept.
+ *
+ * Admission control:
+ \verbatim
+ parcall_max_legs        0       max concurrent outbound legs (0=unlimited)
+ parcall_group_max_legs  0       default max legs per group (0=unlimited)
+ parcall_queue_max       128     max number of queued legs
+ parcall_reject_busy     no      reject incoming calls with 503 while the
+                                 global limit of legs is reached
+ \endverbatim
+ *
+ * Legs that exceed a limit are queued and started as soon as earlier legs
+ * are closed. The queued legs of a group are dropped if the group's call is
+ * answered or hung up. If no leg can be started or queued, /parcall fails
+ * with 503 Service Unavailable.
+ *
+ * Statistics are kept per group and per peer: initiated calls, answered,
+ * failed and cancelled legs and the time-to-answer distribution. A leg is
+ * cancelled if it is terminated because another leg of the group answered,
+ * or by /parhangup before it was answered. A queued leg that is dropped
+ * before it is started also counts as cancelled.
  */
 
+enum {
+	TTA_BUCKETS     = 6,     /**< Number of time-to-answer buckets     */
+	GROUP_HASH_SIZE = 256,   /**< Hash size of parallel call groups    */
+	PEER_HASH_SIZE  = 16,    /**< Hash size of call targets per group  */
+	RETRY_AFTER     = 5,     /**< Retry-After for 503 responses [s]    */
+};
+
+/** Upper bounds of the time-to-answer buckets in [ms]  */
+static const uint64_t tta_bounds[TTA_BUCKETS - 1] = {
+	1000, 2000, 5000, 10000, 30000
+};
+
+/** Parallel call statistics  */
+struct parstats {
+	uint32_t calls;          /**< Initiated calls (group) or legs      */
+	uint32_t answered;       /**< Answered calls                       */
+	uint32_t failed;         /**< Legs closed without being answered   */
+	uint32_t cancelled;      /**< Legs terminated or unqueued by us    */
+	uint64_t tta_sum;        /**< Sum of time-to-answer [ms]           */
+	uint64_t tta_min;        /**< Minimum time-to-answer [ms]          */
+	uint64_t tta_max;        /**< Maximum time-to-answer [ms]          */
+	uint32_t tta_hist[TTA_BUCKETS];  /**< Time-to-answer histogram     */
+};
+
 /** Parallel call module data  */
 static struct {
 	struct hash *pargroups;
 	struct hash *parcalls;
+	uint32_t gen;            /**< Config load generation               */
+
+	struct list pending;     /**< Queued legs (struct parpend)         */
+	uint32_t npending;       /**< Number of queued legs                */
+	struct tmr tmr_pend;     /**< Starts queued legs                   */
+	uint32_t legs;           /**< Number of active legs                */
+	uint32_t max_legs;       /**< Max concurrent legs, 0 = unlimited   */
+	uint32_t group_max_legs; /**< Default max legs per group           */
+	uint32_t queue_max;      /**< Max number of queued legs            */
+	bool reject_busy;        /**< Reject incoming calls while busy     */
 } d;
 
 struct pargroup {
@@ -42,28 +111,60 @@ struct pargroup {
 
 	char *name;
 	struct list peers;       /**< List of parallel call peers          */
+	struct hash *peerh;      /**< Parallel call peers by address       */
+	struct list calls;       /**< List of active parallel calls        */
+	struct parstats stats;   /**< Group statistics                     */
+	bool conf;               /**< Group was loaded from config         */
+	uint32_t gen;            /**< Config load generation               */
+	struct list pending;     /**< Queued legs of this group            */
+	uint32_t legs;           /**< Number of active legs                */
+	uint32_t max_legs;       /**< Max concurrent legs, 0 = unlimited   */
 };
 
 struct parpeer {
 	struct le le;
+	struct le he;
 
 	struct ua *ua;
 	char *addr;
-	const struct pargroup *group;
+	struct pargroup *group;
+	struct parstats stats;   /**< Peer statistics                      */
+	bool conf;               /**< Peer was loaded from config          */
+	uint32_t gen;            /**< Config load generation               */
 };
 
 struct parcall {
 	struct le hle;
+	struct le le;            /**< Member of the group's call list      */
 
 	struct call *call;
-	const struct pargroup *group;
+	struct pargroup *group;  /**< Referenced while the call is active  */
+	struct parpeer *peer;    /**< Referenced while the call is active  */
+	uint64_t ts_start;       /**< Start time of the leg [ms]           */
+	bool answered;           /**< Leg was answered by the peer         */
+	bool cancelled;          /**< Leg was terminated by us             */
 	struct tmr tmr;
 };
 
+/** Queued call leg  */
+struct parpend {
+	struct le le;            /**< Member of the global queue           */
+	struct le gle;           /**< Member of the group's queue          */
+
+	struct pargroup *group;
+	struct parpeer *peer;
+	enum sdp_dir adir;
+	enum sdp_dir vdir;
+	bool dialed;             /**< Leg was started from the queue       */
+};
+
 struct callarg {
 	struct re_printf *pf;
 	enum sdp_dir adir;
 	enum sdp_dir vdir;
+	uint32_t started;        /**< Number of started legs               */
+	uint32_t queued;         /**< Number of queued legs                */
+	uint32_t dropped;        /**< Number of legs not admitted          */
 };
 
 
@@ -73,6 +174,7 @@ static void pargroup_destructor(void *arg)
 
 	mem_deref(g->name);
 	list_flush(&g->peers);
+	mem_deref(g->peerh);
 	hash_unlink(&g->hle);
 }
 
@@ -82,6 +184,7 @@ static void parpeer_destructor(void *arg)
 	struct parpeer *p = arg;
 
 	list_unlink(&p->le);
+	hash_unlink(&p->he);
 	mem_deref(p->addr);
 }
 
@@ -92,6 +195,81 @@ static void parcall_destructor(void *arg)
 
 	tmr_cancel(&c->tmr);
 	hash_unlink(&c->hle);
+	list_unlink(&c->le);
+	--c->group->legs;
+	--d.legs;
+	mem_deref(c->peer);
+	mem_deref(c->group);
+}
+
+
+static void parpend_destructor(void *arg)
+{
+	struct parpend *p = arg;
+
+	list_unlink(&p->le);
+	list_unlink(&p->gle);
+	--d.npending;
+
+	/* a queued leg that is dropped counts as cancelled */
+	if (!p->dialed) {
+		++p->group->stats.cancelled;
+		++p->peer->stats.cancelled;
+	}
+
+	mem_deref(p->peer);
+	mem_deref(p->group);
+}
+
+
+static void parstats_answered(struct parstats *st, uint64_t tta)
+{
+	unsigned i;
+
+	for (i = 0; i < RE_ARRAY_SIZE(tta_bounds); i++) {
+		if (tta < tta_bounds[i])
+			break;
+	}
+
+	if (!st->answered || tta < st->tta_min)
+		st->tta_min = tta;
+
+	if (tta > st->tta_max)
+		st->tta_max = tta;
+
+	++st->answered;
+	++st->tta_hist[i];
+	st->tta_sum += tta;
+}
+
+
+static void parstats_print(struct re_printf *pf, const char *indent,
+			   const struct parstats *st)
+{
+	unsigned i;
+
+	(void)re_hprintf(pf, "%scalls: %u answered: %u failed: %u "
+			 "cancelled: %u\n", indent,
+			 st->calls, st->answered, st->failed, st->cancelled);
+	if (!st->answered)
+		return;
+
+	(void)re_hprintf(pf, "%stime-to-answer [ms] min/avg/max: "
+			 "%llu/%llu/%llu\n", indent,
+			 st->tta_min, st->tta_sum / st->answered, st->tta_max);
+	(void)re_hprintf(pf, "%s", indent);
+	for (i = 0; i < TTA_BUCKETS; i++) {
+		if (i < RE_ARRAY_SIZE(tta_bounds))
+			(void)re_hprintf(pf, " <%llus:%u",
+					 tta_bounds[i] / 1000,
+					 st->tta_hist[i]);
+		else
+			(void)re_hprintf(pf, " >=%llus:%u",
+					 tta_bounds[i - 1] / 1000,
+					 st->tta_hist[i]);
+	}
+
+	(void)re_hprintf(pf, "\n");
 }
 
 
@@ -119,22 +297,56 @@ static bool pargroup_debug(struct le *le, void *arg)
 	struct pargroup *g = le->data;
 	struct re_printf *pf = arg;
 
-	(void)re_hprintf(pf, "Group: %s\n", g->name);
+	(void)re_hprintf(pf, "Group: %s legs: %u/%u queued: %u\n", g->name,
+			 g->legs, g->max_legs, list_count(&g->pending));
 	list_apply(&g->peers, true, parpeer_debug, pf);
 
 	return false;
 }
 
 
-static bool pargroup_hangup(struct le *le, void *arg)
+static bool parpeer_stats(struct le *le, void *arg)
 {
-	struct parcall *c   = le->data;
-	struct pargroup *g0 = arg;
+	struct parpeer *peer = le->data;
+	struct re_printf *pf = arg;
 
-	if (c->group != g0)
-		return false;
+	(void)re_hprintf(pf, "  peer: %s\n", peer->addr);
+	parstats_print(pf, "    ", &peer->stats);
+	return false;
+}
+
+
+static bool pargroup_stats(struct le *le, void *arg)
+{
+	struct pargroup *g = le->data;
+	struct re_printf *pf = arg;
 
+	(void)re_hprintf(pf, "Group: %s\n", g->name);
+	parstats_print(pf, "  ", &g->stats);
+	list_apply(&g->peers, true, parpeer_stats, pf);
+
+	return false;
+}
+
+
+static void parcall_cancelled(struct parcall *c)
+{
+	if (c->answered || c->cancelled)
+		return;
+
+	c->cancelled = true;
+	++c->group->stats.cancelled;
+	++c->peer->stats.cancelled;
+}
+
+
+static bool pargroup_hangup(struct le *le, void *arg)
+{
+	struct parcall *c = le->data;
 	struct call *call = c->call;
+	(void)arg;
+
+	parcall_cancelled(c);
 	(void)ua_hangup(call_get_ua(call), call, 0, NULL);
 
 	return false;
@@ -147,12 +359,11 @@ static bool parcall_hangup(struct le *le, void *arg)
 	struct parcall *c0 = arg;
 	struct call *call;
 
-	if (c->group != c0->group)
-		return false;
-
 	call = c->call;
-	if (call != c0->call)
+	if (call != c0->call) {
+		parcall_cancelled(c);
 		(void)call_hangup(call, 0, NULL);
+	}
 
 	return false;
 }
@@ -174,9 +385,6 @@ static bool parcall_cleanup(struct le *le, void *arg)
 	struct parcall *c0 = arg;
 	struct call *call;
 
-	if (c->group != c0->group)
-		return false;
-
 	call = c->call;
 	if (call != c0->call)
 		tmr_start(&c->tmr, 0, cleanup_parcall, c);
@@ -222,6 +430,118 @@ static struct parcall *find_parcall(const struct call *call)
 }
 
 
+static bool parleg_saturated(void)
+{
+	return d.max_legs && d.legs >= d.max_legs;
+}
+
+
+static bool parleg_admit(const struct pargroup *g)
+{
+	if (parleg_saturated())
+		return false;
+
+	return !g->max_legs || g->legs < g->max_legs;
+}
+
+
+/**
+ * Start a call leg to a parallel call target
+ *
+ * @param peer  Call target
+ * @param adir  Audio direction
+ * @param vdir  Video direction
+ * @param pf    Optional print handler
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int parleg_start(struct parpeer *peer, enum sdp_dir adir,
+			enum sdp_dir vdir, struct re_printf *pf)
+{
+	struct pargroup *g = peer->group;
+	struct call *call;
+	struct parcall *c;
+	int err;
+
+	++peer->stats.calls;
+	err = ua_connect_dir(peer->ua, &call, NULL, peer->addr, VIDMODE_ON,
+			     adir, vdir);
+	if (err) {
+		++peer->stats.failed;
+		++g->stats.failed;
+		return err;
+	}
+
+	if (pf) {
+		re_hprintf(pf, "parallel call uri: %s id: %s "
+			   "audio=%s video=%s\n",
+			   peer->addr, call_id(call),
+			   sdp_dir_name(adir), sdp_dir_name(vdir));
+	}
+	else {
+		info("parcall: queued call uri: %s id: %s\n",
+		     peer->addr, call_id(call));
+	}
+
+	c = mem_zalloc(sizeof(*c), parcall_destructor);
+	if (!c) {
+		ua_hangup(peer->ua, call, 0, NULL);
+		++peer->stats.failed;
+		++g->stats.failed;
+		return ENOMEM;
+	}
+
+	c->call  = call;
+	c->group = mem_ref(g);
+	c->peer  = mem_ref(peer);
+	c->ts_start = tmr_jiffies();
+	hash_append(d.parcalls, hash_fast_str(call_id(call)), &c->hle, c);
+	list_append(&g->calls, &c->le, c);
+	++g->legs;
+	++d.legs;
+	return 0;
+}
+
+
+static int parpend_alloc(struct parpeer *peer, enum sdp_dir adir,
+			 enum sdp_dir vdir)
+{
+	struct parpend *p;
+
+	p = mem_zalloc(sizeof(*p), parpend_destructor);
+	if (!p)
+		return ENOMEM;
+
+	p->group = mem_ref(peer->group);
+	p->peer  = mem_ref(peer);
+	p->adir  = adir;
+	p->vdir  = vdir;
+	list_append(&d.pending, &p->le, p);
+	list_append(&p->group->pending, &p->gle, p);
+	++d.npending;
+	return 0;
+}
+
+
+static void pending_handler(void *arg)
+{
+	struct le *le = list_head(&d.pending);
+	(void)arg;
+
+	while (le && !parleg_saturated()) {
+		struct parpend *p = le->data;
+		le = le->next;
+
+		if (!parleg_admit(p->group))
+			continue;
+
+		p->dialed = true;
+		(void)parleg_start(p->peer, p->adir, p->vdir, NULL);
+		mem_deref(p);
+	}
+}
+
+
 static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 {
 	struct call *call = bevent_get_call(event);
@@ -235,8 +555,14 @@ static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 		if (!pc)
 			break;
 
-		hash_apply(d.parcalls, parcall_hangup, pc);
-		hash_apply(d.parcalls, parcall_cleanup, pc);
+		uint64_t tta = tmr_jiffies() - pc->ts_start;
+		pc->answered = true;
+		parstats_answered(&pc->group->stats, tta);
+		parstats_answered(&pc->peer->stats, tta);
+
+		list_flush(&pc->group->pending);
+		list_apply(&pc->group->calls, true, parcall_hangup, pc);
+		list_apply(&pc->group->calls, true, parcall_cleanup, pc);
 	}
 
 	break;
@@ -246,15 +572,66 @@ static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 		if (!pc)
 			break;
 
+		if (!pc->answered && !pc->cancelled) {
+			++pc->group->stats.failed;
+			++pc->peer->stats.failed;
+		}
+
 		mem_deref(pc);
+		if (d.npending)
+			tmr_start(&d.tmr_pend, 0, pending_handler, NULL);
 	}
 	break;
+	case BEVENT_SIPSESS_CONN:
+		if (!d.reject_busy || !parleg_saturated())
+			break;
+
+		(void)sip_treplyf(NULL, NULL, uag_sip(), bevent_get_msg(event),
+				  false, 503, "Service Unavailable",
+				  "Retry-After: %u\r\n"
+				  "Content-Length: 0\r\n\r\n",
+				  RETRY_AFTER);
+		bevent_stop(event);
+		break;
 	default:
 		break;
 	}
 }
 
 
+static struct pargroup *pargroup_lookup(const struct pl *name)
+{
+	struct le *le;
+
+	le = hash_lookup(d.pargroups, hash_fast(name->p, name->l),
+			 pargroup_search, (void *)name);
+	return le ? le->data : NULL;
+}
+
+
+static int pargroup_alloc(struct pargroup **gp, const struct pl *name)
+{
+	struct pargroup *g;
+	int err;
+
+	g = mem_zalloc(sizeof(*g), pargroup_destructor);
+	if (!g)
+		return ENOMEM;
+
+	err  = pl_strdup(&g->name, name);
+	err |= hash_alloc(&g->peerh, PEER_HASH_SIZE);
+	if (err) {
+		mem_deref(g);
+		return err;
+	}
+
+	g->max_legs = d.group_max_legs;
+	hash_append(d.pargroups, hash_fast_str(g->name), &g->hle, g);
+	*gp = g;
+	return 0;
+}
+
+
 /*
  * Create a parallel call group with given name
  *
@@ -269,7 +646,6 @@ static int cmd_mkpar(struct re_printf *pf, void *arg)
 	struct cmd_arg *carg = arg;
 	struct pargroup *g;
 	struct pl name;
-	int err;
 
 	const char *usage = "usage: /mkpar <name>\n";
 
@@ -279,42 +655,29 @@ static int cmd_mkpar(struct re_printf *pf, void *arg)
 	}
 
 	pl_set_str(&name, carg->prm);
-	if (hash_lookup(d.pargroups, hash_fast_str(carg->prm), pargroup_search,
-			&name)) {
+	if (pargroup_lookup(&name)) {
 		(void)re_hprintf(pf, "mkpar: call group %r already exists\n",
 				 &name);
 		return EINVAL;
 	}
 
-	g = mem_zalloc(sizeof(*g), pargroup_destructor);
-	if (!g)
-		return ENOMEM;
-
-	err = str_dup(&g->name, carg->prm);
-	if (err) {
-		mem_deref(g);
-		return err;
-	}
-
-	hash_append(d.pargroups, hash_fast_str(g->name), &g->hle, g);
-	return 0;
+	return pargroup_alloc(&g, &name);
 }
 
 
 static struct pargroup *find_pargroup(struct re_printf *pf, struct pl *name,
 			       const char *cmd)
 {
-	struct le *le;
+	struct pargroup *g;
 
-	le = hash_lookup(d.pargroups, hash_fast(name->p, name->l),
-			 pargroup_search, name);
-	if (!le) {
+	g = pargroup_lookup(name);
+	if (!g) {
 		(void)re_hprintf(pf, "%s: call group %r does not exist\n",
 				 cmd, name);
 		return NULL;
 	}
 
-	return le->data;
+	return g;
 }
 
 
@@ -326,31 +689,141 @@ static bool parpeer_find(struct le *le, void *arg)
 }
 
 
+static void parpeer_remove(struct parpeer *peer)
+{
+	struct le *le;
+
+	/* the queued legs of the peer are not dialed anymore */
+	le = list_head(&peer->group->pending);
+	while (le) {
+		struct parpend *p = le->data;
+		le = le->next;
+
+		if (p->peer == peer)
+			mem_deref(p);
+	}
+
+	/* active parallel calls may still hold a reference */
+	list_unlink(&peer->le);
+	hash_unlink(&peer->he);
+	mem_deref(peer);
+}
+
+
+/**
+ * Decode a call target definition
+ *
+ * @param pl     Input: <name> <URI> or <name> <display name> <sip:uri>
+ * @param name   Returns the group name
+ * @param dname  Returns the optional display name
+ * @param addr   Returns the SIP address
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int parpeer_decode(const struct pl *pl, struct pl *name,
+			  struct pl *dname, struct pl *addr)
+{
+	int err;
+
+	/* full form with display name */
+	err = re_regex(pl->p, pl->l,
+		"[^ ]+ [~ \t\r\n<]*[ \t\r\n]*<[^>]+>[ \t\r\n]*",
+		name, dname, NULL, addr);
+	if (err) {
+		*dname = pl_null;
+		err = re_regex(pl->p, pl->l, "[^ ]+ [^ ]+", name, addr);
+	}
+
+	if (err)
+		return err;
+
+	if (!pl_isset(name) || !pl_isset(addr))
+		return EINVAL;
+
+	return 0;
+}
+
+
+/**
+ * Add a call target to a group
+ *
+ * @param peerp  Returns the new call target, or the existing one
+ * @param g      Parallel call group
+ * @param dname  Optional display name
+ * @param addr   SIP address
+ *
+ * @return 0 if success, EALREADY if the target exists, otherwise errorcode
+ */
+static int parpeer_add(struct parpeer **peerp, struct pargroup *g,
+		       const struct pl *dname, const struct pl *addr)
+{
+	struct parpeer *peer;
+	struct le *le;
+	struct ua *ua;
+	char *addrstr;
+	uint32_t key;
+	int err;
+
+	ua = uag_find_requri_pl(addr);
+	if (!ua)
+		return ENOENT;
+
+	if (pl_isset(dname)) {
+		err = re_sdprintf(&addrstr, "\"%r\" <%r>", dname, addr);
+	}
+	else {
+		err = account_uri_complete_strdup(ua_account(ua), &addrstr,
+						  addr);
+	}
+
+	if (err)
+		return err;
+
+	key = hash_joaat_str(addrstr);
+	le  = hash_lookup(g->peerh, key, parpeer_find, addrstr);
+	if (le) {
+		mem_deref(addrstr);
+		*peerp = le->data;
+		return EALREADY;
+	}
+
+	peer = mem_zalloc(sizeof(*peer), parpeer_destructor);
+	if (!peer) {
+		mem_deref(addrstr);
+		return ENOMEM;
+	}
+
+	peer->ua    = ua;
+	peer->group = g;
+	peer->addr  = addrstr;
+	list_append(&g->peers, &peer->le, peer);
+	hash_append(g->peerh, key, &peer->he, peer);
+
+	*peerp = peer;
+	return 0;
+}
+
+
 static bool parpeer_call(struct le *le, void *arg)
 {
 	struct parpeer *peer = le->data;
 	struct callarg *callarg = arg;
-	struct call *call;
-	struct parcall *c;
-	int err;
 
-	err = ua_connect_dir(peer->ua, &call, NULL, peer->addr, VIDMODE_ON,
-			     callarg->adir, callarg->vdir);
-	if (err)
-		return false;
+	if (parleg_admit(peer->group)) {
+		if (!parleg_start(peer, callarg->adir, callarg->vdir,
+				  callarg->pf))
+			++callarg->started;
 
-	re_hprintf(callarg->pf, "parallel call uri: %s id: %s "
-		   "audio=%s video=%s\n",
-		   peer->addr, call_id(call),
-		   sdp_dir_name(callarg->adir), sdp_dir_name(callarg->vdir));
+		return false;
+	}
 
-	c = mem_zalloc(sizeof(*c), parcall_destructor);
-	if (!c)
-		return true;
+	if (d.npending >= d.queue_max ||
+	    parpend_alloc(peer, callarg->adir, callarg->vdir)) {
+		++callarg->dropped;
+		return false;
+	}
 
-	c->call  = call;
-	c->group = peer->group;
-	hash_append(d.parcalls, hash_fast_str(call_id(call)), &c->hle, c);
+	++callarg->queued;
 	return false;
 }
 
@@ -378,8 +851,12 @@ static int cmd_rmpar(struct re_printf *pf, void *arg)
 
 	pl_set_str(&name, carg->prm);
 	g = find_pargroup(pf, &name, "rmpar");
-	if (g)
+	if (g) {
+		/* active parallel calls may still hold a reference */
+		list_flush(&g->pending);
+		hash_unlink(&g->hle);
 		mem_deref(g);
+	}
 
 	return 0;
 }
@@ -397,6 +874,7 @@ static int cmd_clrpar(struct re_printf *pf, void *arg)
 {
 	(void)arg;
 
+	list_flush(&d.pending);
 	hash_flush(d.pargroups);
 	(void)re_hprintf(pf, "parcall: cleared parallel call groups\n");
 
@@ -416,81 +894,143 @@ static int cmd_clrpar(struct re_printf *pf, void *arg)
 static int cmd_paradd(struct re_printf *pf, void *arg)
 {
 	struct cmd_arg *carg = arg;
-	struct pl name, addr;
-	char *addrstr;
+	struct pl prm, name, addr;
 	struct pl dname = PL_INIT;
 	struct pargroup *g;
 	struct parpeer *peer;
-	struct ua *ua;
 	int err;
 	const char *usage = "usage: /paradd <name> <URI>\n"
 			    "       /paradd <name> <display name> <sip:uri>\n";
 
-	/* full form with display name */
-	err = re_regex(carg->prm, str_len(carg->prm),
-		"[^ ]+ [~ \t\r\n<]*[ \t\r\n]*<[^>]+>[ \t\r\n]*",
-		&name, &dname, NULL, &addr);
-	if (err) {
-		dname = pl_null;
-		err = re_regex(carg->prm, str_len(carg->prm), "[^ ]+ [^ ]+",
-			       &name, &addr);
-	}
-
+	pl_set_str(&prm, carg->prm);
+	err = parpeer_decode(&prm, &name, &dname, &addr);
 	if (err) {
 		(void)re_hprintf(pf, usage);
 		return err;
 	}
 
-	if (!pl_isset(&name) || !pl_isset(&addr)) {
-		(void)re_hprintf(pf, usage);
-		return EINVAL;
-	}
-
 	g = find_pargroup(pf, &name, "paradd");
 	if (!g)
 		return EINVAL;
 
-	ua = uag_find_requri_pl(&addr);
-	if (!ua) {
+	err = parpeer_add(&peer, g, &dname, &addr);
+	switch (err) {
+
+	case ENOENT:
 		(void)re_hprintf(pf, "paradd: could not find UA for %r\n",
 				 &addr);
 		return EINVAL;
+
+	case EALREADY:
+		(void)re_hprintf(pf, "paradd: %s already a target of %r\n",
+				 peer->addr, &name);
+		return EINVAL;
+
+	default:
+		break;
 	}
 
-	if (pl_isset(&dname)) {
-		err = re_sdprintf(&addrstr, "\"%r\" <%r>", &dname, &addr);
+	return err;
+}
+
+
+static int pargroup_conf_handler(const struct pl *val, void *arg)
+{
+	struct pl name, addr;
+	struct pl dname = PL_INIT;
+	struct pargroup *g;
+	struct parpeer *peer;
+	int err;
+	(void)arg;
+
+	err = parpeer_decode(val, &name, &dname, &addr);
+	if (err) {
+		warning("parcall: could not decode parcall_group %r\n", val);
+		return 0;
 	}
-	else {
-		err = account_uri_complete_strdup(ua_account(ua), &addrstr,
-						  &addr);
+
+	g = pargroup_lookup(&name);
+	if (!g) {
+		err = pargroup_alloc(&g, &name);
+		if (err)
+			return err;
+
+		g->conf = true;
 	}
 
-	if (err)
-		goto out;
+	g->gen = d.gen;
 
-	if (list_apply(&g->peers, true, parpeer_find, addrstr)) {
-		(void)re_hprintf(pf, "paradd: %s already a target of %r\n",
-				 addrstr, &name);
-		err = EINVAL;
-		goto out;
+	err = parpeer_add(&peer, g, &dname, &addr);
+	if (err == ENOENT) {
+		warning("parcall: could not find UA for %r\n", &addr);
+		return 0;
+	}
+	else if (err && err != EALREADY) {
+		return err;
 	}
 
-	peer = mem_zalloc(sizeof(*peer), parpeer_destructor);
-	if (!peer) {
-		err = ENOMEM;
-		goto out;
+	peer->conf = true;
+	peer->gen  = d.gen;
+	return 0;
+}
+
+
+static bool parpeer_stale(struct le *le, void *arg)
+{
+	struct parpeer *peer = le->data;
+	(void)arg;
+
+	if (peer->conf && peer->gen != d.gen)
+		parpeer_remove(peer);
+
+	return false;
+}
+
+
+static bool pargroup_stale(struct le *le, void *arg)
+{
+	struct pargroup *g = le->data;
+	(void)arg;
+
+	list_apply(&g->peers, true, parpeer_stale, NULL);
+	if (!g->conf || g->gen == d.gen)
+		return false;
+
+	/* targets added with /paradd keep the group */
+	if (!list_isempty(&g->peers)) {
+		info("parcall: group %s is no longer configured, keeping "
+		     "%u added targets\n", g->name, list_count(&g->peers));
+		g->conf = false;
+		return false;
 	}
 
-	peer->ua    = ua;
-	peer->group = g;
-	peer->addr  = addrstr;
-	list_append(&g->peers, &peer->le, peer);
+	list_flush(&g->pending);
+	hash_unlink(&g->hle);
+	mem_deref(g);
 
-out:
+	return false;
+}
+
+
+/**
+ * Load the parallel call groups from the config. Groups and targets that
+ * were loaded before and are no longer configured are removed, unchanged
+ * ones are kept together with their statistics
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int pargroup_load(void)
+{
+	int err;
+
+	++d.gen;
+	err = conf_apply(conf_cur(), "parcall_group", pargroup_conf_handler,
+			 NULL);
 	if (err)
-		mem_deref(addrstr);
+		return err;
 
-	return err;
+	(void)hash_apply(d.pargroups, pargroup_stale, NULL);
+	return 0;
 }
 
 
@@ -555,7 +1095,24 @@ static int cmd_parcall(struct re_printf *pf, void *arg)
 		return EINVAL;
 	}
 
+	++g->stats.calls;
 	(void)list_apply(&g->peers, true, parpeer_call, &callarg);
+
+	if (callarg.queued)
+		(void)re_hprintf(pf, "parcall: %u legs queued\n",
+				 callarg.queued);
+
+	if (!callarg.dropped)
+		return 0;
+
+	if (!callarg.started && !callarg.queued) {
+		(void)re_hprintf(pf, "parcall: 503 Service Unavailable "
+				 "(legs: %u/%u queued: %u/%u)\n",
+				 d.legs, d.max_legs, d.npending, d.queue_max);
+		return EBUSY;
+	}
+
+	(void)re_hprintf(pf, "parcall: %u legs dropped\n", callarg.dropped);
 	return 0;
 }
 
@@ -588,7 +1145,46 @@ static int cmd_parhangup(struct re_printf *pf, void *arg)
 	if (!g)
 		return EINVAL;
 
-	hash_apply(d.parcalls, pargroup_hangup, g);
+	list_flush(&g->pending);
+	list_apply(&g->calls, true, pargroup_hangup, NULL);
+	return 0;
+}
+
+
+/**
+ * Limit the number of concurrent call legs of a group
+ *
+ * @param pf   Print handler
+ * @param arg  Command arguments (carg)
+ *             carg->prm holds: <name> <max>
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_parlimit(struct re_printf *pf, void *arg)
+{
+	struct cmd_arg *carg = arg;
+	struct pargroup *g;
+	struct pl name, max;
+	int err;
+
+	const char *usage = "usage: /parlimit <name> <max legs>\n"
+			    "       max legs 0 means unlimited\n";
+
+	err = re_regex(carg->prm, str_len(carg->prm), "[^ ]+ [0-9]+",
+		       &name, &max);
+	if (err) {
+		(void)re_hprintf(pf, usage);
+		return EINVAL;
+	}
+
+	g = find_pargroup(pf, &name, "parlimit");
+	if (!g)
+		return EINVAL;
+
+	g->max_legs = pl_u32(&max);
+	if (d.npending)
+		tmr_start(&d.tmr_pend, 0, pending_handler, NULL);
+
 	return 0;
 }
 
@@ -605,7 +1201,8 @@ static int cmd_pardebug(struct re_printf *pf, void *arg)
 {
 	(void)arg;
 
-	(void)re_hprintf(pf, "Parallel call groups\n");
+	(void)re_hprintf(pf, "Parallel call groups (legs: %u/%u queued: %u/%u)"
+			 "\n", d.legs, d.max_legs, d.npending, d.queue_max);
 	(void)hash_apply(d.pargroups, pargroup_debug, pf);
 	(void)re_hprintf(pf, "\n");
 
@@ -616,6 +1213,55 @@ static int cmd_pardebug(struct re_printf *pf, void *arg)
 }
 
 
+/**
+ * Print statistics of all parallel call groups and their peers
+ *
+ * @param pf   Print handler
+ * @param arg  not used
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_parstats(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	(void)re_hprintf(pf, "Parallel call statistics\n");
+	(void)hash_apply(d.pargroups, pargroup_stats, pf);
+	(void)re_hprintf(pf, "\n");
+	return 0;
+}
+
+
+/**
+ * Reload parallel call groups from the config
+ *
+ * @param pf   Print handler
+ * @param arg  not used
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_parreload(struct re_printf *pf, void *arg)
+{
+	int err;
+	(void)arg;
+
+	err = conf_configure();
+	if (err) {
+		(void)re_hprintf(pf, "parreload failed (%m)\n", err);
+		return err;
+	}
+
+	err = pargroup_load();
+	if (err) {
+		(void)re_hprintf(pf, "parreload failed (%m)\n", err);
+		return err;
+	}
+
+	(void)re_hprintf(pf, "parcall: reloaded parallel call groups\n");
+	return 0;
+}
+
+
 static const struct cmd cmdv[] = {
 	{"mkpar",    0,CMD_PRM, "Create parallel call group",    cmd_mkpar   },
 	{"rmpar",    0,CMD_PRM, "Remove parallel call group",    cmd_rmpar   },
@@ -625,6 +1271,12 @@ static const struct cmd cmdv[] = {
 								 cmd_parcall },
 	{"parhangup",0,CMD_PRM, "Hangup parallel call group",   cmd_parhangup},
 	{"pardebug", 0,      0, "Print parallel call data",	 cmd_pardebug},
+	{"parstats", 0,      0, "Print parallel call statistics",
+								cmd_parstats},
+	{"parreload",0,      0, "Reload parallel call groups from config",
+							       cmd_parreload},
+	{"parlimit", 0,CMD_PRM, "Limit concurrent call legs of a group",
+								cmd_parlimit},
 };
 
 
@@ -633,11 +1285,23 @@ static int module_init(void)
 	int err;
 
 	memset(&d, 0, sizeof(d));
-	err  = hash_alloc(&d.pargroups, 32);
+	d.queue_max = 128;
+	(void)conf_get_u32(conf_cur(), "parcall_max_legs", &d.max_legs);
+	(void)conf_get_u32(conf_cur(), "parcall_group_max_legs",
+			   &d.group_max_legs);
+	(void)conf_get_u32(conf_cur(), "parcall_queue_max", &d.queue_max);
+	(void)conf_get_bool(conf_cur(), "parcall_reject_busy",
+			    &d.reject_busy);
+
+	err  = hash_alloc(&d.pargroups, GROUP_HASH_SIZE);
 	err |= hash_alloc(&d.parcalls,  32);
 	if (err)
 		return err;
 
+	err = pargroup_load();
+	if (err)
+		warning("parcall: could not load groups (%m)\n", err);
+
 	err  = bevent_register(event_handler, NULL);
 	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 	if (err)
@@ -652,6 +1316,8 @@ static int module_close(void)
 {
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
+	tmr_cancel(&d.tmr_pend);
+	list_flush(&d.pending);
 	hash_flush(d.pargroups);
 	hash_flush(d.parcalls);
 	d.pargroups = mem_deref(d.pargroups);
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <re.h>
 #include <baresip.h>
+#include <accextra.h>
+#include <tmrwheel.h>
 
 
 /**
@@ -29,33 +31,253 @@
  * In this case, the sending of OPTIONS still continues and if a subsequent
  * OPTIONS is answered, a BEVENT_MODULE with "peer online" is triggered.
  *
+ * Calls from the same peer address and transport share one peer object,
+ * which sends the OPTIONS with the shortest interval and timeout of its
+ * calls and reports the result to each call. The number of requests thus
+ * depends on the number of peers, not on the number of calls. The
+ * intervals of all peers are driven by one timing wheel and are jittered
+ * by +/-10%, so that the OPTIONS of many peers do not burst.
+ *
+ * For each peer the round-trip time of the OPTIONS is tracked as smoothed
+ * RTT and RTT variation (jitter), and the loss rate as moving average of
+ * unanswered requests. They are combined to a health score from 0 to 100.
+ * If the score drops below the configured threshold, a BEVENT_MODULE with
+ * "peer degraded" is triggered for the calls of the peer; "peer healthy"
+ * is triggered once it is 10 points above the threshold again. The
+ * command /qualify_stats prints the statistics of all peers.
+ *
+ * When the last call of a peer is established or closed, only the OPTIONS
+ * are stopped. The peer and its statistics are kept for the next calls
+ * and are removed after 10 minutes without calls. A call to a peer that
+ * is still degraded gets the "peer degraded" event right away.
+ *
+ * Configuration:
+ * qualify_degraded   [0-100]   health score threshold (default 50)
+ *
  * Example:
  * <sip:A@sip.example.com>;extra=qual_int=5,qual_to=2
  *
  */
 
 
+enum {
+	WHEEL_TICK  = 100,       /**< Timing wheel resolution [ms]         */
+	JITTER      = 10,        /**< Interval jitter [%]                  */
+	HYSTERESIS  = 10,        /**< Health score hysteresis              */
+	RTT_GOOD    = 150,       /**< RTT without score penalty [ms]       */
+	PEER_IDLE   = 600,       /**< Expiry of a peer without calls [s]   */
+};
+
+
+/** Qualify settings of an account  */
+struct qualacc {
+	uint32_t qual_int;       /**< Qualify interval [s]                 */
+	uint32_t qual_to;        /**< Qualify timeout [s]                  */
+};
+
+
+/** OPTIONS statistics of a peer  */
+struct qualstats {
+	uint32_t sent;           /**< Sent requests                        */
+	uint32_t answered;       /**< Answered in time                     */
+	uint32_t lost;           /**< Not answered in time                 */
+	uint32_t rtt;            /**< Last round-trip time [ms]            */
+	uint32_t srtt;           /**< Smoothed round-trip time [ms]        */
+	uint32_t rttvar;         /**< Round-trip time variation [ms]       */
+	uint32_t loss;           /**< Smoothed loss rate [1/1000]          */
+	uint32_t score;          /**< Health score 0-100                   */
+	bool degraded;           /**< Score is below the threshold         */
+};
+
+
+/** Peer address and transport of one or more calls  */
+struct qualpeer {
+	struct le he;
+	struct sa addr;          /**< Peer address                         */
+	enum sip_transp tp;      /**< SIP transport                        */
+	char uri[128];           /**< OPTIONS Request-URI                  */
+	struct list calls;       /**< Qualified calls (qualle)             */
+	struct tmrwheel_tmr int_tmr;  /**< Interval, or idle expiry      */
+	uint32_t qual_int;       /**< Shortest interval of the calls [s]   */
+	uint32_t qual_to;        /**< Shortest timeout of the calls [s]    */
+	struct qualprobe *probe; /**< OPTIONS in progress                  */
+	struct qualstats st;
+};
+
+
+/** OPTIONS request to a peer  */
+struct qualprobe {
+	struct qualpeer *peer;
+	struct tmrwheel_tmr to_tmr;
+	uint32_t qual_to;
+	uint64_t ts_sent;        /**< Send time [ms]                       */
+	bool done;               /**< Answered or timed out                */
+};
+
+
 struct qualle {
 	struct le he;
+	struct le ple;           /**< Entry in the call list of the peer   */
 	struct call *call;
+	struct qualacc *cfg;
+	struct qualpeer *peer;
 	bool offline;
-	struct tmr int_tmr;
-	struct tmr to_tmr;
 };
 
 
 struct qualify {
 	struct hash *qual_map;
+	struct accextra_cache accx;  /**< Settings per account          */
+	struct hash *peer_map;
+	struct tmrwheel wheel;
+	uint32_t degraded;       /**< Health score threshold               */
+};
+
+
+static struct qualify q = {
+	.degraded = 50,
+};
+
+
+static uint64_t jitter(uint32_t sec)
+{
+	uint64_t ms = sec * 1000ULL;
+	uint64_t range = ms * JITTER / 100;
+
+	return ms - range + rand_u32() % (2 * range + 1);
+}
+
+
+/* Parse the settings of an account, NULL if qualify is not enabled */
+static void *qualacc_parse(const struct account *acc)
+{
+	struct qualacc *qa;
+	uint32_t qual_int = 0;
+	uint32_t qual_to = 0;
+
+	(void)account_extra_u32(acc, "qual_int", &qual_int);
+	(void)account_extra_u32(acc, "qual_to", &qual_to);
+
+	if (!qual_int || !qual_to)
+		return NULL;
+
+	if (qual_to >= qual_int) {
+		warning("qualify: timeout >= interval (%u >= %u)\n",
+			qual_to, qual_int);
+		return NULL;
+	}
+
+	qa = mem_zalloc(sizeof(*qa), NULL);
+	if (!qa)
+		return NULL;
+
+	qa->qual_int = qual_int;
+	qa->qual_to  = qual_to;
+
+	return qa;
+}
+
+
+static void qualpeer_destructor(void *arg)
+{
+	struct qualpeer *peer = arg;
+
+	hash_unlink(&peer->he);
+	tmrwheel_tmr_cancel(&peer->int_tmr);
+}
+
+
+struct qualpeer_key {
+	const struct sa *addr;
+	enum sip_transp tp;
 };
 
 
-static struct qualify q = { NULL };
+static uint32_t qualpeer_hash(const struct sa *addr, enum sip_transp tp)
+{
+	return sa_hash(addr, SA_ALL) ^ (uint32_t)tp;
+}
+
+
+static bool qualpeer_cmp_handler(struct le *le, void *arg)
+{
+	const struct qualpeer *peer = le->data;
+	const struct qualpeer_key *key = arg;
+
+	return peer->tp == key->tp && sa_cmp(&peer->addr, key->addr, SA_ALL);
+}
+
+
+static struct qualpeer *qualpeer_get(const struct sa *addr,
+				     enum sip_transp tp)
+{
+	struct qualpeer_key key = {addr, tp};
+	struct qualpeer *peer;
+	int n;
+
+	peer = list_ledata(hash_lookup(q.peer_map, qualpeer_hash(addr, tp),
+				       qualpeer_cmp_handler, &key));
+	if (peer)
+		return mem_ref(peer);
+
+	peer = mem_zalloc(sizeof(*peer), qualpeer_destructor);
+	if (!peer)
+		return NULL;
+
+	n = re_snprintf(peer->uri, sizeof(peer->uri), "sip:%J%s", addr,
+			sip_transp_param(tp));
+	if (n <= 0) {
+		mem_deref(peer);
+		return NULL;
+	}
+
+	sa_cpy(&peer->addr, addr);
+	peer->tp = tp;
+
+	/* the peer map keeps the peer until it is idle */
+	hash_append(q.peer_map, qualpeer_hash(addr, tp), &peer->he, peer);
+
+	return mem_ref(peer);
+}
 
 
-/* Forward declaration */
-static void call_start_qualify(struct call *call,
-			       const struct account *acc,
-			       struct qualle *qualle);
+static void idle_handler(void *arg)
+{
+	struct qualpeer *peer = arg;
+
+	if (!list_isempty(&peer->calls))
+		return;
+
+	debug("qualify: %s idle, removed\n", peer->uri);
+
+	hash_unlink(&peer->he);
+	mem_deref(peer);
+}
+
+
+/* Use the shortest interval and timeout of all calls of the peer */
+static void qualpeer_update(struct qualpeer *peer)
+{
+	struct le *le;
+
+	peer->qual_int = 0;
+	peer->qual_to  = 0;
+
+	for (le = list_head(&peer->calls); le; le = le->next) {
+		const struct qualle *qualle = le->data;
+
+		if (!peer->qual_int || qualle->cfg->qual_int < peer->qual_int)
+			peer->qual_int = qualle->cfg->qual_int;
+
+		if (!peer->qual_to || qualle->cfg->qual_to < peer->qual_to)
+			peer->qual_to = qualle->cfg->qual_to;
+	}
+
+	/* stop the pings, keep the statistics for the next calls */
+	if (!peer->qual_int)
+		tmrwheel_tmr_start(&q.wheel, &peer->int_tmr,
+				   PEER_IDLE * 1000ULL, idle_handler, peer);
+}
 
 
 static void qualle_destructor(void *arg)
@@ -63,150 +285,279 @@ static void qualle_destructor(void *arg)
 	struct qualle *qualle = arg;
 
 	hash_unlink(&qualle->he);
-	tmr_cancel(&qualle->to_tmr);
-	tmr_cancel(&qualle->int_tmr);
+
+	if (qualle->ple.list) {
+		list_unlink(&qualle->ple);
+		qualpeer_update(qualle->peer);
+	}
+
+	mem_deref(qualle->peer);
+	mem_deref(qualle->cfg);
 }
 
 
-/**
- * Get specified field in the accounts extra parameter list
- *
- * @param acc  Accounts object
- * @param n    Specified field
- * @param v    uint32_t ptr for the specified value
- *
- * @return 0 if success, otherwise errorcode
- */
-static int account_extra_uint(const struct account *acc, const char *n,
-			      uint32_t *v)
+static void qualprobe_destructor(void *arg)
 {
-	struct pl pl;
-	struct pl val;
-	const char *extra = NULL;
+	struct qualprobe *probe = arg;
 
-	if (!acc || !n  || !v)
-		return EINVAL;
+	tmrwheel_tmr_cancel(&probe->to_tmr);
 
-	extra = account_extra(acc);
-	if (!str_isset(extra))
-		return EINVAL;
+	if (probe->peer->probe == probe)
+		probe->peer->probe = NULL;
 
-	pl_set_str(&pl, extra);
-	if (!fmt_param_sep_get(&pl, n, ',', &val))
-		return EINVAL;
+	mem_deref(probe->peer);
+}
 
-	*v = pl_u32(&val);
 
-	return 0;
+static void qualle_online(struct qualle *qualle)
+{
+	if (!qualle->offline || !qualle->call)
+		return;
+
+	qualle->offline = false;
+	module_event("qualify", "peer online",
+		     call_get_ua(qualle->call), qualle->call, "");
+}
+
+
+static void qualle_offline(struct qualle *qualle)
+{
+	if (qualle->offline || !qualle->call)
+		return;
+
+	qualle->offline = true;
+	module_event("qualify", "peer offline",
+		     call_get_ua(qualle->call), qualle->call, "");
+}
+
+
+static uint32_t udiff(uint32_t a, uint32_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+
+static void qualstats_update(struct qualstats *st, bool answered,
+			     uint32_t rtt)
+{
+	uint32_t pen_loss, pen_rtt, pen_jitter, pen;
+
+	if (answered) {
+		if (!st->answered) {
+			st->srtt   = rtt;
+			st->rttvar = rtt / 2;
+		}
+		else {
+			/* RFC 6298 with alpha 1/8 and beta 1/4 */
+			st->rttvar = (3 * st->rttvar +
+				      udiff(st->srtt, rtt)) / 4;
+			st->srtt   = (7 * st->srtt + rtt) / 8;
+		}
+
+		++st->answered;
+		st->rtt  = rtt;
+		st->loss = 7 * st->loss / 8;
+	}
+	else {
+		++st->lost;
+		st->loss = (7 * st->loss + 1000) / 8;
+	}
+
+	pen_loss   = st->loss / 10;
+	pen_rtt    = st->srtt > RTT_GOOD ?
+		     min((st->srtt - RTT_GOOD) / 20, 50u) : 0;
+	pen_jitter = min(st->rttvar / 10, 20u);
+	pen        = pen_loss + pen_rtt + pen_jitter;
+
+	st->score = pen < 100 ? 100 - pen : 0;
+}
+
+
+/* Report the health state to the calls of the peer */
+static void qualpeer_health(struct qualpeer *peer)
+{
+	const char *ev;
+	struct le *le;
+
+	if (!peer->st.degraded && peer->st.score < q.degraded) {
+		peer->st.degraded = true;
+		ev = "peer degraded";
+	}
+	else if (peer->st.degraded &&
+		 peer->st.score >= q.degraded + HYSTERESIS) {
+		peer->st.degraded = false;
+		ev = "peer healthy";
+	}
+	else {
+		return;
+	}
+
+	info("qualify: %s %s (score %u)\n", peer->uri, ev, peer->st.score);
+
+	for (le = list_head(&peer->calls); le; le = le->next) {
+		struct qualle *qualle = le->data;
+
+		module_event("qualify", ev, call_get_ua(qualle->call),
+			     qualle->call, "%s,%u,%u,%u", peer->uri,
+			     peer->st.score, peer->st.srtt,
+			     peer->st.loss / 10);
+	}
 }
 
 
 static void options_resp_handler(int err, const struct sip_msg *msg, void *arg)
 {
 	(void)msg;
-	struct qualle *qualle = arg;
+	struct qualprobe *probe = arg;
+	struct le *le;
 
 	if (err) {
 		info("qualify: OPTIONS reply error (%m)\n", err);
-		mem_deref(qualle);
+
+		if (!probe->done) {
+			qualstats_update(&probe->peer->st, false, 0);
+			qualpeer_health(probe->peer);
+		}
+
+		mem_deref(probe);
 		return;
 	}
 
-	tmr_cancel(&qualle->to_tmr);
-
-	if (qualle->offline && qualle->call) {
-		qualle->offline = false;
-		module_event("qualify", "peer online",
-			     call_get_ua(qualle->call), qualle->call, "");
+	if (!probe->done) {
+		qualstats_update(&probe->peer->st, true,
+				 (uint32_t)(tmr_jiffies() - probe->ts_sent));
+		qualpeer_health(probe->peer);
 	}
 
-	mem_deref(qualle);
+	for (le = list_head(&probe->peer->calls); le; le = le->next)
+		qualle_online(le->data);
+
+	mem_deref(probe);
 }
 
 
 static void to_handler(void *arg)
 {
-	struct qualle *qualle = arg;
-	struct call *call = qualle->call;
-	uint32_t qual_to = 0;
-	account_extra_uint(call_account(call), "qual_to", &qual_to);
+	struct qualprobe *probe = arg;
+	struct le *le;
 
-	if (!qualle->offline) {
-		qualle->offline = true;
-		module_event("qualify", "peer offline",
-			     call_get_ua(qualle->call), qualle->call, "");
-	}
+	/* the next interval sends a new request, this one may still be
+	 * answered and reports the peer online */
+	probe->peer->probe = NULL;
+	probe->done = true;
+
+	qualstats_update(&probe->peer->st, false, 0);
+	qualpeer_health(probe->peer);
+
+	for (le = list_head(&probe->peer->calls); le; le = le->next)
+		qualle_offline(le->data);
 
 	debug("qualify: no response received to OPTIONS in %u seconds",
-	      qual_to);
+	      probe->qual_to);
+}
+
+
+static void qualprobe_send(struct qualpeer *peer)
+{
+	const struct qualle *qualle = list_ledata(list_head(&peer->calls));
+	struct qualprobe *probe;
+	int err;
+
+	if (!qualle || peer->probe)
+		return;
+
+	probe = mem_zalloc(sizeof(*probe), qualprobe_destructor);
+	if (!probe)
+		return;
+
+	probe->peer    = mem_ref(peer);
+	probe->qual_to = peer->qual_to;
+
+	/* the probe is owned by the OPTIONS transaction */
+	err = ua_options_send(call_get_ua(qualle->call), peer->uri,
+			      options_resp_handler, probe);
+	if (err) {
+		warning("qualify: sending OPTIONS failed (%m)\n", err);
+		mem_deref(probe);
+		return;
+	}
+
+	++peer->st.sent;
+	peer->probe = probe;
+	probe->ts_sent = tmr_jiffies();
+	tmrwheel_tmr_start(&q.wheel, &probe->to_tmr,
+			   probe->qual_to * 1000ULL, to_handler, probe);
 }
 
 
 static void interval_handler(void *arg)
 {
-	struct qualle *qualle = arg;
-	call_start_qualify(qualle->call, call_account(qualle->call), qualle);
+	struct qualpeer *peer = arg;
+
+	tmrwheel_tmr_start(&q.wheel, &peer->int_tmr,
+			   jitter(peer->qual_int), interval_handler, peer);
+
+	qualprobe_send(peer);
 }
 
 
-static void call_start_qualify(struct call *call,
-			      const struct account *acc,
-			      struct qualle *qualle)
+static void qualpeer_add(struct qualpeer *peer, struct qualle *qualle)
 {
-	struct sa peer_addr;
-	char peer_uri[128];
-	uint32_t qual_to = 0;
-	uint32_t qual_int = 0;
-	int newle = qualle == NULL;
+	uint32_t qual_int = peer->qual_int;
+
+	list_append(&peer->calls, &qualle->ple, qualle);
+	qualpeer_update(peer);
+
+	if (qualle->call && peer->st.degraded)
+		module_event("qualify", "peer degraded",
+			     call_get_ua(qualle->call), qualle->call,
+			     "%s,%u,%u,%u", peer->uri, peer->st.score,
+			     peer->st.srtt, peer->st.loss / 10);
+
+	/* the first call starts the pings, a shorter interval applies
+	 * from now on */
+	if (!qual_int)
+		interval_handler(peer);
+	else if (peer->qual_int < qual_int)
+		tmrwheel_tmr_start(&q.wheel, &peer->int_tmr,
+				   jitter(peer->qual_int), interval_handler,
+				   peer);
+}
 
-	account_extra_uint(acc, "qual_int", &qual_int);
-	account_extra_uint(acc, "qual_to", &qual_to);
 
-	if (!call || !qual_int || !qual_to)
-		return;
+static void call_start_qualify(struct call *call, struct account *acc)
+{
+	struct qualle *qualle;
+	struct qualacc *cfg;
+	struct sa peer_addr;
 
-	if (qual_to >= qual_int) {
-		warning("qualify: timeout >= interval (%u >= %u)\n",
-			qual_to, qual_int);
+	if (!call)
 		return;
-	}
-
-	if (newle) {
-		qualle = mem_zalloc(sizeof(*qualle), qualle_destructor);
-		if (!qualle)
-			return;
 
-		qualle->call = call;
-		tmr_init(&qualle->to_tmr);
-		tmr_init(&qualle->int_tmr);
-		hash_append(q.qual_map, hash_fast_str(call_id(call)),
-			    &qualle->he, qualle);
-	}
+	cfg = accextra_get(&q.accx, acc);
+	if (!cfg)
+		return;
 
 	(void)call_msg_src(call, &peer_addr);
 
-	int n = re_snprintf(peer_uri, sizeof(peer_uri),
-			  "sip:%J%s", &peer_addr,
-			  sip_transp_param(call_transp(call)));
+	qualle = mem_zalloc(sizeof(*qualle), qualle_destructor);
+	if (!qualle)
+		return;
 
-	if (n <= 0) {
+	qualle->call = call;
+	qualle->cfg  = mem_ref(cfg);
+	qualle->peer = qualpeer_get(&peer_addr, call_transp(call));
+	if (!qualle->peer) {
 		warning("qualify: failed to get peer URI for %s\n",
 			call_peeruri(call));
-		return;
-	}
-
-	int err = ua_options_send(call_get_ua(call), peer_uri,
-				  options_resp_handler, mem_ref(qualle));
-	if (err) {
 		mem_deref(qualle);
-		warning("qualify: sending OPTIONS failed (%m)\n", err);
-		tmr_start(&qualle->int_tmr, qual_int * 1000, interval_handler,
-			  qualle);
 		return;
 	}
 
-	tmr_start(&qualle->to_tmr, qual_to * 1000, to_handler, qualle);
-	tmr_start(&qualle->int_tmr, qual_int * 1000, interval_handler, qualle);
+	hash_append(q.qual_map, hash_fast_str(call_id(call)),
+		    &qualle->he, qualle);
+
+	qualpeer_add(qualle->peer, qualle);
 }
 
 
@@ -231,47 +582,83 @@ static struct qualle *call_get_qualle(struct call *call)
 }
 
 
-static void qualle_stop_tmrs(struct qualle *qualle)
+static int qualpeer_print(struct re_printf *pf, const struct qualpeer *peer)
 {
-	if (!qualle)
-		return;
+	const struct qualstats *st = &peer->st;
+
+	return re_hprintf(pf, "%-40s %5u %5u %5u %5u %5u %5u %5u %3u.%u%% "
+			  "%3u%s\n",
+			  peer->uri, list_count(&peer->calls),
+			  st->sent, st->answered, st->lost,
+			  st->rtt, st->srtt, st->rttvar,
+			  st->loss / 10, st->loss % 10, st->score,
+			  st->degraded ? " degraded" : "");
+}
 
-	tmr_cancel(&qualle->to_tmr);
-	tmr_cancel(&qualle->int_tmr);
+
+static bool qualpeer_print_handler(struct le *le, void *arg)
+{
+	(void)qualpeer_print(arg, le->data);
+
+	return false;
+}
+
+
+static int cmd_qualify_stats(struct re_printf *pf, void *arg)
+{
+	int err;
+	(void)arg;
+
+	err = re_hprintf(pf, "%-40s %5s %5s %5s %5s %5s %5s %5s %6s %5s\n",
+			 "peer", "calls", "sent", "ok", "lost", "rtt", "srtt",
+			 "jitt", "loss", "score");
+
+	(void)hash_apply(q.peer_map, qualpeer_print_handler, pf);
+
+	return err;
 }
 
 
+static const struct cmd cmdv[] = {
+	{"qualify_stats", 0, 0, "Qualify peer statistics", cmd_qualify_stats},
+};
+
+
 static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 {
 	struct ua   *ua   = bevent_get_ua(event);
 	struct call *call = bevent_get_call(event);
 	struct account *acc = ua_account(ua);
-	struct qualle *qualle;
 	(void) arg;
 
 	switch (ev) {
+		case BEVENT_CREATE:
+			(void)accextra_get(&q.accx, acc);
+			break;
+
+		case BEVENT_UNREGISTERING:
+			accextra_cache_remove(&q.accx, acc);
+			break;
+
+		case BEVENT_SHUTDOWN:
+			accextra_cache_flush(&q.accx);
+			break;
+
 		case BEVENT_CALL_INCOMING:
-			(void)call_start_qualify(call, acc, NULL);
+			call_start_qualify(call, acc);
 			break;
 
 		case BEVENT_CALL_ESTABLISHED:
 			if (call_is_outgoing(call))
 			    break;
 
-			qualle = call_get_qualle(call);
-			qualle_stop_tmrs(qualle);
+			mem_deref(call_get_qualle(call));
 			break;
 
 		case BEVENT_CALL_CLOSED:
-			qualle = call_get_qualle(call);
-			qualle_stop_tmrs(qualle);
-
-			if (qualle) {
-				qualle->call = NULL;
-				mem_deref(qualle);
-			}
-
+			mem_deref(call_get_qualle(call));
 			break;
+
 		default:
 			break;
 	}
@@ -284,8 +671,14 @@ static int module_init(void)
 
 	info("qualify: init\n");
 
+	(void)conf_get_u32(conf_cur(), "qualify_degraded", &q.degraded);
+	tmrwheel_init(&q.wheel, WHEEL_TICK);
+
 	err  = bevent_register(event_handler, NULL);
 	err |= hash_alloc(&q.qual_map, 32);
+	err |= accextra_cache_init(&q.accx, qualacc_parse);
+	err |= hash_alloc(&q.peer_map, 32);
+	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 
 	return err;
 }
@@ -293,9 +686,16 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	cmd_unregister(baresip_commands(), cmdv);
 	bevent_unregister(event_handler);
 	hash_flush(q.qual_map);
-	mem_deref(q.qual_map);
+	q.qual_map = mem_deref(q.qual_map);
+	accextra_cache_close(&q.accx);
+
+	/* peers may still be referenced by pending OPTIONS */
+	hash_flush(q.peer_map);
+	q.peer_map = mem_deref(q.peer_map);
+	tmrwheel_close(&q.wheel);
 
 	return 0;
 }
@@ -5,6 +5,8 @@
  */
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -43,11 +45,23 @@
  * uaredirect_add <ua-idx> [scode=<scode>] [reason=<reason>]
  *			   [contact=<target contact>] [expires=<expires/s>]
  *			   [params=<diversion params>]
+ *			   [caller=<caller prefix>] [subject=<subject prefix>]
+ *			   [time=<hh:mm-hh:mm>]
  *			   Default: scode=302 reason="Moved Temporarily"
  *				    contact="" params=""
  *   Default:
  *   scode=302, reason="Moved Temporarily", empty Contact header, no expiry,
- *   no params for Diversion header.
+ *   no params for Diversion header, no conditions.
+ *
+ *   Each UA has a list of redirection rules. A rule only applies if the
+ *   user part of the From URI starts with `caller`, the Subject header
+ *   starts with `subject` (case-insensitive), and the local time is within
+ *   `time`. A window like 18:00-07:00 spans midnight, 00:00-24:00 is all
+ *   day, and a window with the same start and end is rejected. The first
+ *   matching rule redirects the call, rules without conditions are matched
+ *   last. Adding a rule with the same conditions as an existing one
+ *   replaces it. The conditions are compiled when the rule is added, and
+ *   uaredirect_debug prints the hit count of each rule.
  *
  * uaredirect_rm <ua-idx>
  *
@@ -59,23 +73,51 @@
  *   Default:
  *   Rejects fist incoming call, scode=302, reason="Moved Temporarily",
  *   empty Contact header, no expiry, no params for Diversion header.
+ *
+ * The redirects are hashed by UA, and the headers of the response are
+ * rendered when the redirect is added. Only the remaining expires time is
+ * inserted when an INVITE is redirected. An incoming INVITE thus costs one
+ * hash lookup and one reply, independent of the number of redirects.
  */
 
-/** Redirect list set by user  */
+
+enum {
+	REDIR_HASH_SIZE = 64,
+};
+
+/** Redirects set by user, hashed by UA  */
 static struct {
-	struct list redirs;
-} d = { LIST_INIT };
+	struct hash *redirs;
+} d;
+
+/** Redirection rules of a UA  */
+struct redir_ua {
+	struct le he;
 
-/** Redirection  */
+	struct ua *ua;
+	struct list rules;       /**< Rules in match order (redirect)      */
+};
+
+/** Redirection rule  */
 struct redirect {
 	struct le le;
+	struct redir_ua *rua;
+
+	char *caller;            /**< Caller user prefix                   */
+	size_t callerlen;
+	char *subject;           /**< Subject prefix, case-insensitive     */
+	size_t subjectlen;
+	int tw_start;            /**< Time window start [min], -1 if none  */
+	int tw_end;              /**< Time window end [min]                */
 
-	struct ua *ua;
 	uint16_t scode;
 	char *reason;
 	struct tmr tmr;
 	char *contact;
 	char *divparams;
+	char *hdrs;              /**< Rendered response headers            */
+	size_t exppos;           /**< Position of the expires parameter    */
+	uint64_t hits;           /**< Redirected calls                     */
 };
 
 /** Redirection command parsing structure  */
@@ -86,6 +128,17 @@ struct redir_params {
 
 	struct pl contact;
 	struct pl divparams;
+
+	struct pl caller;
+	struct pl subject;
+	struct pl time;
+};
+
+/** Attributes of an incoming INVITE that the rules are matched against */
+struct redir_req {
+	struct pl caller;        /**< User part of the From URI            */
+	struct pl subject;       /**< Subject header value                 */
+	int minute;              /**< Local time of day [min], -1 if unset */
 };
 
 
@@ -93,34 +146,227 @@ static void redirect_destructor(void *arg)
 {
 	struct redirect *r = arg;
 
+	list_unlink(&r->le);
 	tmr_cancel(&r->tmr);
+	mem_deref(r->caller);
+	mem_deref(r->subject);
 	mem_deref(r->reason);
 	mem_deref(r->contact);
 	mem_deref(r->divparams);
+	mem_deref(r->hdrs);
+}
+
+
+static void redir_ua_destructor(void *arg)
+{
+	struct redir_ua *rua = arg;
+
+	hash_unlink(&rua->he);
+	list_flush(&rua->rules);
+}
+
+
+/**
+ * Render the headers of the redirect response
+ *
+ * @param r Redirection
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int redirect_render(struct redirect *r)
+{
+	int err;
+
+	err = re_sdprintf(&r->hdrs,
+			  "Contact: <%s>\r\n"
+			  "Diversion: <%s>%s\r\n"
+			  "Content-Length: 0\r\n\r\n",
+			  r->contact,
+			  account_aor(ua_account(r->rua->ua)), r->divparams);
+	if (err)
+		return err;
+
+	/* the expires parameter follows the Contact URI */
+	r->exppos = str_len("Contact: <>") + str_len(r->contact);
+
+	return 0;
+}
+
+
+/**
+ * Send the redirect response
+ *
+ * @param r   Redirection
+ * @param msg Incoming INVITE
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int redirect_reply(const struct redirect *r,
+			  const struct sip_msg *msg)
+{
+	uint64_t ms;
+
+	if (!tmr_isrunning(&r->tmr))
+		return sip_treplyf(NULL, NULL, uag_sip(), msg, false,
+				   r->scode, r->reason, "%s", r->hdrs);
+
+	ms = tmr_get_expire(&r->tmr);
+
+	return sip_treplyf(NULL, NULL, uag_sip(), msg, false,
+			   r->scode, r->reason, "%b;expires=%llu%s",
+			   r->hdrs, r->exppos, (ms + 999) / 1000,
+			   r->hdrs + r->exppos);
 }
 
 
 static bool redirect_search(struct le *le, void *arg)
 {
-	struct redirect *r = le->data;
+	struct redir_ua *rua = le->data;
 	struct ua *ua = arg;
 
-	return r->ua == ua;
+	return rua->ua == ua;
+}
+
+
+static uint32_t redirect_key(const struct ua *ua)
+{
+	return hash_fast((const char *)&ua, sizeof(ua));
+}
+
+
+static struct redir_ua *redirect_find(const struct ua *ua)
+{
+	struct le *le;
+
+	le = hash_lookup(d.redirs, redirect_key(ua), redirect_search,
+			 (void *)ua);
+
+	return list_ledata(le);
+}
+
+
+static bool prefix_match(const struct pl *pl, const char *p, size_t n,
+			 bool icase)
+{
+	size_t i;
+
+	if (pl->l < n)
+		return false;
+
+	if (!icase)
+		return !memcmp(pl->p, p, n);
+
+	for (i = 0; i < n; i++) {
+		if (tolower((unsigned char)pl->p[i]) !=
+		    tolower((unsigned char)p[i]))
+			return false;
+	}
+
+	return true;
+}
+
+
+/* Local time of day, only computed for rules with a time window */
+static int redir_req_minute(struct redir_req *req)
+{
+	time_t now;
+	const struct tm *tm;
+
+	if (req->minute >= 0)
+		return req->minute;
+
+	now = time(NULL);
+	tm  = localtime(&now);
+	req->minute = tm ? tm->tm_hour * 60 + tm->tm_min : 0;
+
+	return req->minute;
+}
+
+
+static bool redirect_match(const struct redirect *r, struct redir_req *req)
+{
+	int minute;
+
+	if (!prefix_match(&req->caller, r->caller, r->callerlen, false))
+		return false;
+
+	if (!prefix_match(&req->subject, r->subject, r->subjectlen, true))
+		return false;
+
+	if (r->tw_start < 0)
+		return true;
+
+	minute = redir_req_minute(req);
+	if (r->tw_start < r->tw_end)
+		return minute >= r->tw_start && minute < r->tw_end;
+
+	/* the window spans midnight */
+	return minute >= r->tw_start || minute < r->tw_end;
+}
+
+
+/**
+ * Find the first rule of a UA that matches an incoming INVITE
+ *
+ * @param rua Redirection rules of the UA
+ * @param msg Incoming INVITE
+ *
+ * @return Matching rule, NULL if none
+ */
+static struct redirect *redirect_lookup(const struct redir_ua *rua,
+					const struct sip_msg *msg)
+{
+	const struct sip_hdr *hdr = sip_msg_hdr(msg, SIP_HDR_SUBJECT);
+	struct redir_req req;
+	struct le *le;
+
+	req.caller = msg->from.uri.user;
+	req.minute = -1;
+	if (hdr)
+		req.subject = hdr->val;
+	else
+		pl_set_str(&req.subject, "");
+
+	for (le = list_head(&rua->rules); le; le = le->next) {
+		struct redirect *r = le->data;
+
+		if (redirect_match(r, &req))
+			return r;
+	}
+
+	return NULL;
 }
 
 
 static bool redirect_debug(struct le *le, void *arg)
 {
-	struct redirect *r = le->data;
+	struct redir_ua *rua = le->data;
 	struct re_printf *pf = arg;
+	struct le *rle;
 
-	(void)re_hprintf(pf, "%s %u %s expires in %lu [ms]",
-		  account_aor(ua_account(r->ua)), r->scode, r->reason,
-		  tmr_get_expire(&r->tmr));
-	if (str_isset(r->contact))
-		(void)re_hprintf(pf, " --> %s", r->contact);
+	for (rle = list_head(&rua->rules); rle; rle = rle->next) {
+		const struct redirect *r = rle->data;
+
+		(void)re_hprintf(pf, "%s %u %s expires in %lu [ms]",
+				 account_aor(ua_account(rua->ua)), r->scode,
+				 r->reason, tmr_get_expire(&r->tmr));
+		if (str_isset(r->contact))
+			(void)re_hprintf(pf, " --> %s", r->contact);
+
+		if (r->callerlen)
+			(void)re_hprintf(pf, " caller=%s", r->caller);
+
+		if (r->subjectlen)
+			(void)re_hprintf(pf, " subject=%s", r->subject);
+
+		if (r->tw_start >= 0)
+			(void)re_hprintf(pf, " time=%02d:%02d-%02d:%02d",
+					 r->tw_start / 60, r->tw_start % 60,
+					 r->tw_end / 60, r->tw_end % 60);
+
+		(void)re_hprintf(pf, " hits=%llu\n", r->hits);
+	}
 
-	(void)re_hprintf(pf, "\n");
 	return false;
 }
 
@@ -128,9 +374,11 @@ static bool redirect_debug(struct le *le, void *arg)
 static void redirect_expired(void *arg)
 {
 	struct redirect *r  = arg;
+	struct redir_ua *rua = r->rua;
 
-	list_unlink(&r->le);
 	mem_deref(r);
+	if (list_isempty(&rua->rules))
+		mem_deref(rua);
 }
 
 
@@ -153,36 +401,23 @@ static int expires_alloc(char **bufp, uint32_t expires)
 
 static void event_handler(enum bevent_ev ev, struct bevent *event, void *arg)
 {
-	struct le *le;
 	const struct sip_msg *msg = bevent_get_msg(event);
-	struct ua *ua = uag_find_msg(msg);
 
 	(void)arg;
 
 	switch (ev) {
 	case BEVENT_SIPSESS_CONN:
 	{
-		le = list_apply(&d.redirs, true, redirect_search, ua);
-		if (!le)
+		struct redir_ua *rua = redirect_find(uag_find_msg(msg));
+		if (!rua)
 			break;
 
-		struct redirect *r = le->data;
-		char *expstr = NULL;
-		int err = expires_alloc(&expstr,
-			  (uint32_t) tmr_get_expire(&r->tmr));
-		if (err)
-			return;
-
-		(void)sip_treplyf(NULL, NULL, uag_sip(), msg, false,
-				  r->scode, r->reason,
-				  "Contact: <%s>%s\r\n"
-				  "Diversion: <%s>%s\r\n"
-				  "Content-Length: 0\r\n\r\n",
-				  r->contact,
-				  expstr,
-				  account_aor(ua_account(ua)),
-				  r->divparams);
-		mem_deref(expstr);
+		struct redirect *r = redirect_lookup(rua, msg);
+		if (!r)
+			break;
+
+		++r->hits;
+		(void)redirect_reply(r, msg);
 		bevent_stop(event);
 	}
 
@@ -213,15 +448,7 @@ static struct ua *carg_get_ua(const struct cmd_arg *carg)
 
 static void ua_redir_clear(struct ua *ua)
 {
-	struct le *le;
-
-	le = list_apply(&d.redirs, true, redirect_search, ua);
-	if (!le)
-		return;
-
-	struct redirect *r = le->data;
-	list_unlink(&r->le);
-	mem_deref(r);
+	mem_deref(redirect_find(ua));
 }
 
 
@@ -236,12 +463,119 @@ static void redirect_parse(struct redir_params *params,
 	fmt_param_sep_get(&pl, "reason",  ' ', &params->reason);
 	fmt_param_sep_get(&pl, "contact", ' ', &params->contact);
 	fmt_param_sep_get(&pl, "params",  ' ', &params->divparams);
+	fmt_param_sep_get(&pl, "caller",  ' ', &params->caller);
+	fmt_param_sep_get(&pl, "subject", ' ', &params->subject);
+	fmt_param_sep_get(&pl, "time",    ' ', &params->time);
 	fmt_param_sep_get(&pl, "expires", ' ', &v);
 	if (pl_isset(&v))
 		params->expires = pl_u32(&v);
 }
 
 
+/**
+ * Compile the conditions of a rule
+ *
+ * @param r      Redirection rule
+ * @param params Parsed command parameters
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int redirect_compile(struct redirect *r,
+			    const struct redir_params *params)
+{
+	struct pl h1, m1, h2, m2;
+	int err = 0;
+
+	r->tw_start = -1;
+
+	if (pl_isset(&params->caller)) {
+		err = pl_strdup(&r->caller, &params->caller);
+		r->callerlen = params->caller.l;
+	}
+
+	if (pl_isset(&params->subject)) {
+		err |= pl_strdup(&r->subject, &params->subject);
+		r->subjectlen = params->subject.l;
+	}
+
+	if (err || !pl_isset(&params->time))
+		return err;
+
+	err = re_regex(params->time.p, params->time.l,
+		       "[0-9]+:[0-9]+-[0-9]+:[0-9]+", &h1, &m1, &h2, &m2);
+	if (err)
+		return err;
+
+	if (pl_u32(&m1) > 59 || pl_u32(&m2) > 59)
+		return EINVAL;
+
+	r->tw_start = pl_u32(&h1) * 60 + pl_u32(&m1);
+	r->tw_end   = pl_u32(&h2) * 60 + pl_u32(&m2);
+
+	/* an empty window is ambiguous, 00:00-24:00 is all day */
+	if (r->tw_start == r->tw_end)
+		return EINVAL;
+
+	return r->tw_start < 24 * 60 && r->tw_end <= 24 * 60 ? 0 : EINVAL;
+}
+
+
+static bool redirect_conditional(const struct redirect *r)
+{
+	return r->callerlen || r->subjectlen || r->tw_start >= 0;
+}
+
+
+static bool redirect_same_cond(const struct redirect *a,
+			       const struct redirect *b)
+{
+	return !str_cmp(a->caller ? a->caller : "",
+			b->caller ? b->caller : "") &&
+	       !str_casecmp(a->subject ? a->subject : "",
+			    b->subject ? b->subject : "") &&
+	       a->tw_start == b->tw_start &&
+	       (a->tw_start < 0 || a->tw_end == b->tw_end);
+}
+
+
+/**
+ * Add a rule to the rules of a UA
+ *
+ * A rule with the same conditions is replaced. Rules without conditions
+ * are matched after all conditional rules.
+ *
+ * @param rua Redirection rules of the UA
+ * @param r   New rule
+ */
+static void redir_ua_add(struct redir_ua *rua, struct redirect *r)
+{
+	struct le *le = list_head(&rua->rules);
+
+	while (le) {
+		struct redirect *o = le->data;
+		le = le->next;
+
+		if (redirect_same_cond(o, r))
+			mem_deref(o);
+	}
+
+	if (!redirect_conditional(r)) {
+		list_append(&rua->rules, &r->le, r);
+		return;
+	}
+
+	for (le = list_head(&rua->rules); le; le = le->next) {
+		if (!redirect_conditional(le->data))
+			break;
+	}
+
+	if (le)
+		list_insert_before(&rua->rules, le, &r->le, r);
+	else
+		list_append(&rua->rules, &r->le, r);
+}
+
+
 static int cmd_redir_add(struct re_printf *pf, void *arg)
 {
 	const struct cmd_arg *carg = arg;
@@ -252,28 +586,41 @@ static int cmd_redir_add(struct re_printf *pf, void *arg)
 			    "[reason=<reason>] "
 			    "[contact=<target contact>] "
 			    "[expires=<expires/s>] "
-			    "[params=<diversion params>]\n"
+			    "[params=<diversion params>] "
+			    "[caller=<caller prefix>] "
+			    "[subject=<subject prefix>] "
+			    "[time=<hh:mm-hh:mm>]\n"
 			    "Default: scode=302, "
 			    "reason=\"Moved Temporarily\", "
-			    "no contact, no expiry, no params\n";
+			    "no contact, no expiry, no params, "
+			    "no conditions\n";
 
 	if (!ua) {
 		re_hprintf(pf, usage);
 		return EINVAL;
 	}
 
+	struct redir_ua *rua = redirect_find(ua);
 	struct redirect *r;
 	int err;
 
-	ua_redir_clear(ua);
 	r = mem_zalloc(sizeof(*r), redirect_destructor);
-	r->ua = ua;
+	if (!r)
+		return ENOMEM;
+
 	tmr_init(&r->tmr);
 
 	struct redir_params params = { 0 };
 	redirect_parse(&params, carg);
 	r->scode = pl_isset(&params.scode) ? pl_u32(&params.scode) : 302;
 
+	err = redirect_compile(r, &params);
+	if (err) {
+		re_hprintf(pf, usage);
+		mem_deref(r);
+		return err;
+	}
+
 	if (pl_isset(&params.reason))
 		err = pl_strdup(&r->reason, &params.reason);
 	else
@@ -288,10 +635,30 @@ static int cmd_redir_add(struct re_printf *pf, void *arg)
 	if (pl_isset(&params.divparams))
 		err = pl_strdup(&r->divparams, &params.divparams);
 
-	list_append(&d.redirs, &r->le, r);
+	if (!rua) {
+		rua = mem_zalloc(sizeof(*rua), redir_ua_destructor);
+		if (!rua) {
+			mem_deref(r);
+			return ENOMEM;
+		}
+
+		rua->ua = ua;
+		hash_append(d.redirs, redirect_key(ua), &rua->he, rua);
+	}
+
+	r->rua = rua;
+	err |= redirect_render(r);
+	if (err) {
+		mem_deref(r);
+		if (list_isempty(&rua->rules))
+			mem_deref(rua);
+		return err;
+	}
+
+	redir_ua_add(rua, r);
 	re_hprintf(pf, "redirect: added redirection\n");
-	list_apply(&d.redirs, true, redirect_debug, pf);
-	return err;
+	hash_apply(d.redirs, redirect_debug, pf);
+	return 0;
 }
 
 
@@ -309,7 +676,7 @@ static int cmd_redir_rm(struct re_printf *pf, void *arg)
 	ua_redir_clear(ua);
 	re_hprintf(pf, "redirect: removed redirection of %s\n",
 		   account_aor(ua_account(ua)));
-	list_apply(&d.redirs, true, redirect_debug, pf);
+	hash_apply(d.redirs, redirect_debug, pf);
 	return 0;
 }
 
@@ -318,7 +685,7 @@ static int cmd_redir_debug(struct re_printf *pf, void *arg)
 {
 	(void) arg;
 	re_hprintf(pf, "redirect: current redirections\n");
-	list_apply(&d.redirs, true, redirect_debug, pf);
+	hash_apply(d.redirs, redirect_debug, pf);
 	return 0;
 }
 
@@ -442,7 +809,8 @@ static int module_init(void)
 {
 	int err;
 
-	err  = bevent_register(event_handler, NULL);
+	err  = hash_alloc(&d.redirs, REDIR_HASH_SIZE);
+	err |= bevent_register(event_handler, NULL);
 	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 	if (err)
 		return err;
@@ -456,7 +824,8 @@ static int module_close(void)
 {
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
-	list_flush(&d.redirs);
+	hash_flush(d.redirs);
+	d.redirs = mem_deref(d.redirs);
 	return 0;
 }
 